@@ -1,5 +1,7 @@
 #include "agenda_entry.h"
 #include "arena.h"
+#include "intern.h"
+#include "pool.h"
 #include "util.h"
 #include <dirent.h>
 #include <libical/ical.h>
@@ -16,6 +18,29 @@
 #include <uuid/uuid.h>
 #include <wordexp.h>
 
+static struct pool entry_pool = POOL_INITIALIZER(struct agenda_entry, 1024);
+
+static void
+free_filename(struct agenda_entry *entry)
+{
+	if (entry->filename != entry->inline_filename)
+		free(entry->filename);
+}
+
+void
+set_agenda_entry_filename(struct agenda_entry *entry, const char *filename)
+{
+	size_t len = strlen(filename);
+	char *copy = len < AGENDA_ENTRY_INLINE_FILENAME
+			 ? entry->inline_filename
+			 : xmalloc(len + 1);
+	// The new name may be the old one
+	memmove(copy, filename, len + 1);
+	if (entry->filename != copy)
+		free_filename(entry);
+	entry->filename = copy;
+}
+
 struct agenda_entry *
 copy_agenda_entry(const struct agenda_entry *src)
 {
@@ -23,9 +48,13 @@ copy_agenda_entry(const struct agenda_entry *src)
 	if (!src) {
 		return NULL;
 	}
-	struct agenda_entry *copy = xmalloc(sizeof(struct agenda_entry));
-	copy->filename = xstrdup(src->filename);
-	copy->filename_vdir = xstrdup(src->filename_vdir);
+	struct agenda_entry *copy = pool_alloc(&entry_pool);
+	copy->filename = NULL;
+	set_agenda_entry_filename(copy, src->filename);
+	copy->filename_vdir = intern(src->filename_vdir);
+	copy->uid = intern(src->uid);
+	copy->description_size = src->description_size;
+	copy->is_directory = src->is_directory;
 	return copy;
 }
 
@@ -34,20 +63,28 @@ free_agenda_entry(struct agenda_entry *entry)
 {
 	if (!entry)
 		return;
-	if (entry->filename)
-		free(entry->filename);
-	if (entry->filename_vdir)
-		free(entry->filename_vdir);
-	free(entry);
+	free_filename(entry);
+	release_interned(entry->filename_vdir);
+	release_interned(entry->uid);
+	pool_free(&entry_pool, entry);
 	return;
 }
 
+size_t
+agenda_entry_pool_size(void)
+{
+	return pool_size(&entry_pool);
+}
+
 struct agenda_entry *
 create_agenda_entry(arena *ar, const char *filename,
-		    const char *filename_vdir)
+		    const char *filename_vdir, const char *uid)
 {
 	struct agenda_entry *copy = rmalloc(ar, sizeof(struct agenda_entry));
 	copy->filename = rstrdup(ar, filename);
 	copy->filename_vdir = rstrdup(ar, filename_vdir);
+	copy->uid = rstrdup(ar, uid);
+	copy->description_size = 0;
+	copy->is_directory = false;
 	return copy;
 }
@@ -21,23 +21,44 @@
 #include <uuid/uuid.h>
 #include <wordexp.h>
 
+// Most display names fit, so they need no allocation of their own
+#define AGENDA_ENTRY_INLINE_FILENAME 40
+
 struct agenda_entry {
 	// filename is full path relative to fuse directory
 	// I.E. hello world
 	char *filename;
 	// filename_original is the relative path to ICS_DIR
 	// I.E. 910319208nrao19p.ics
-	char *filename_vdir;
+	const char *filename_vdir;
+	// UID property of the journal entry
+	const char *uid;
+	// Metadata of the file, kept up to date by write_ical_file so
+	// getattr does not have to read the file
+	size_t description_size;
+	bool is_directory;
+	// Holds filename if it is short enough, in copies only
+	char inline_filename[AGENDA_ENTRY_INLINE_FILENAME];
 };
 
+// The copy is taken from a pool and interns filename_vdir and uid, see
+// intern.h
 struct agenda_entry *
 copy_agenda_entry(const struct agenda_entry *src);
 
+// Only for copies
+void
+set_agenda_entry_filename(struct agenda_entry *entry, const char *filename);
+
+// Bytes held by the pool of copies
+size_t
+agenda_entry_pool_size(void);
+
 void
 free_agenda_entry(struct agenda_entry *entry);
 
 struct agenda_entry *
 create_agenda_entry(arena *ar, const char *filename,
-		    const char *filename_vdir);
+		    const char *filename_vdir, const char *uid);
 #endif // agenda_entry_h_INCLUDED
 
@@ -2,102 +2,475 @@
 #include "util.h"
 #include <assert.h>
 #include <libical/ical.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef void (*free_func_t)(void *);
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+#define ARENA_ALIGN(size) \
+	(((size) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+// Most operations fit in the first chunk
+#define ARENA_FIRST_CHUNK_SIZE 2048
+#define ARENA_CHUNK_SIZE 16384
+// Thread arenas keep at most this much memory between operations
+#define ARENA_HIGH_WATER_MARK (256 * 1024)
+
+static pthread_key_t thread_arena_key;
+static pthread_once_t thread_arena_once = PTHREAD_ONCE_INIT;
+static _Thread_local arena *thread_arena = NULL;
+static _Thread_local bool thread_arena_in_use = false;
+
+// Distinct sites counted per arena, the rest are counted as "other"
+#define ARENA_SITES 32
+#define ARENA_MAX_OPS 32
+#define ARENA_MAX_SITES 512
+// Operations by bytes allocated, under 256 bytes up to 256K and more
+#define ARENA_HISTOGRAM_BUCKETS 12
+#define ARENA_TOP_SITES 20
+
+struct op_stats {
+	const char *op;
+	size_t operations;
+	size_t bytes;
+	size_t allocations;
+	size_t new_chunks;
+	size_t destructors;
+	size_t max_bytes;
+	size_t histogram[ARENA_HISTOGRAM_BUCKETS];
+};
+
+static atomic_bool stats_enabled = false;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+// The first entry counts all operations
+static struct op_stats op_stats[ARENA_MAX_OPS + 1] = {{.op = "all"}};
+static size_t op_stats_count = 1;
+static arena_site site_stats[ARENA_MAX_SITES];
+static size_t site_stats_count = 0;
+
+static void
+init_chunk(arena_chunk *chunk, size_t size)
+{
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+}
+
+static void
+clear_arena_stats(arena *region)
+{
+	region->bytes = 0;
+	region->allocations = 0;
+	region->new_chunks = 0;
+	region->destructors = 0;
+	region->sites = NULL;
+	region->site_count = 0;
+}
 
 arena *
 create_arena(void)
 {
-	arena *region = xmalloc(sizeof(arena));
+	size_t header = ARENA_ALIGN(sizeof(arena));
+	arena *region = xmalloc(header + sizeof(arena_chunk) +
+				ARENA_FIRST_CHUNK_SIZE);
+	region->chunks = (arena_chunk *)((char *)region + header);
+	init_chunk(region->chunks, ARENA_FIRST_CHUNK_SIZE);
+	region->current = region->chunks;
 	region->head = NULL;
+	region->op = NULL;
+	clear_arena_stats(region);
 	return region;
 }
 
+// Continues in the next kept chunk if it fits, otherwise a new chunk is
+// added after the current one. Large allocations get a chunk of their
+// own.
+static arena_chunk *
+next_chunk(arena *region, size_t size)
+{
+	arena_chunk *current = region->current;
+	if (current->next && current->next->size >= size) {
+		region->current = current->next;
+		return region->current;
+	}
+
+	size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+	arena_chunk *chunk = xmalloc(sizeof(arena_chunk) + chunk_size);
+	init_chunk(chunk, chunk_size);
+	chunk->next = current->next;
+	current->next = chunk;
+	region->current = chunk;
+	region->new_chunks++;
+	return chunk;
+}
+
+static void *
+bump(arena *region, size_t size)
+{
+	size = ARENA_ALIGN(size ? size : 1);
+	arena_chunk *chunk = region->current;
+	if (chunk->size - chunk->used < size) {
+		chunk = next_chunk(region, size);
+	}
+	void *ptr = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+static void
+count_allocation(arena *region, size_t size, const char *site)
+{
+	region->bytes += size;
+	region->allocations++;
+
+	// The table is part of the arena, so it is gone after a reset
+	if (!region->sites) {
+		region->sites = bump(region, ARENA_SITES * sizeof(arena_site));
+	}
+	size_t i = 0;
+	while (i < region->site_count && region->sites[i].name != site) {
+		i++;
+	}
+	if (i == region->site_count) {
+		if (i == ARENA_SITES) {
+			i = ARENA_SITES - 1;
+			region->sites[i].name = "other";
+		}
+		else {
+			region->sites[i] = (arena_site){.name = site};
+			region->site_count++;
+		}
+	}
+	region->sites[i].allocations++;
+	region->sites[i].bytes += size;
+}
+
+void *
+rmalloc_at(arena *region, size_t size, const char *site)
+{
+	if (atomic_load_explicit(&stats_enabled, memory_order_relaxed)) {
+		count_allocation(region, size, site);
+	}
+	return bump(region, size);
+}
+
 void
-arena_register(arena *region, void *ptr, free_func_t free_func)
+arena_register_at(arena *region, void *ptr, free_func_t free_func,
+		  const char *site)
 {
 	assert(free_func);
-	memory_block *block = xmalloc(sizeof(memory_block));
+	memory_block *block = bump(region, sizeof(memory_block));
 	block->ptr = ptr;
 	block->free_func = free_func;
 	block->next = region->head;
 	region->head = block;
-}
-
-void *
-rmalloc(arena *region, size_t size)
-{
-	void *ptr = xmalloc(size);
-	arena_register(region, ptr, free);
-	return ptr;
+	if (atomic_load_explicit(&stats_enabled, memory_order_relaxed)) {
+		region->destructors++;
+		count_allocation(region, 0, site);
+	}
 }
 
 // Copies and null terminates a string
 char *
-rstrndup(arena *ar, const char *src, size_t len)
+rstrndup_at(arena *ar, const char *src, size_t len, const char *site)
 {
-	char *buf = rmalloc(ar, len + 1);
+	char *buf = rmalloc_at(ar, len + 1, site);
 	memcpy(buf, src, len);
 	buf[len] = '\0';
 	return buf;
 }
 
+void
+set_arena_stats_enabled(bool enabled)
+{
+	atomic_store(&stats_enabled, enabled);
+}
+
+bool
+arena_stats_enabled(void)
+{
+	return atomic_load(&stats_enabled);
+}
+
+static size_t
+histogram_bucket(size_t bytes)
+{
+	size_t bucket = 0;
+	for (size_t limit = 256; bytes >= limit; limit *= 2) {
+		if (++bucket == ARENA_HISTOGRAM_BUCKETS - 1) {
+			break;
+		}
+	}
+	return bucket;
+}
+
+static void
+add_op_stats(struct op_stats *stats, const arena *region)
+{
+	stats->operations++;
+	stats->bytes += region->bytes;
+	stats->allocations += region->allocations;
+	stats->new_chunks += region->new_chunks;
+	stats->destructors += region->destructors;
+	if (region->bytes > stats->max_bytes) {
+		stats->max_bytes = region->bytes;
+	}
+	stats->histogram[histogram_bucket(region->bytes)]++;
+}
+
+static struct op_stats *
+get_op_stats(const char *op)
+{
+	for (size_t i = 1; i < op_stats_count; i++) {
+		if (strcmp(op_stats[i].op, op) == 0) {
+			return &op_stats[i];
+		}
+	}
+	if (op_stats_count == ARENA_MAX_OPS + 1) {
+		return NULL;
+	}
+	op_stats[op_stats_count].op = op;
+	return &op_stats[op_stats_count++];
+}
+
+static void
+add_site_stats(const arena_site *site)
+{
+	size_t i = 0;
+	while (i < site_stats_count && strcmp(site_stats[i].name, site->name)) {
+		i++;
+	}
+	if (i == site_stats_count) {
+		if (i == ARENA_MAX_SITES) {
+			return;
+		}
+		site_stats[i] = (arena_site){.name = site->name};
+		site_stats_count++;
+	}
+	site_stats[i].allocations += site->allocations;
+	site_stats[i].bytes += site->bytes;
+}
+
+// Adds what the arena counted to the totals of its operation
+static void
+record_arena_stats(arena *region)
+{
+	if (!atomic_load_explicit(&stats_enabled, memory_order_relaxed)) {
+		return;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	add_op_stats(&op_stats[0], region);
+	const char *op = region->op ? region->op : "other";
+	struct op_stats *stats = get_op_stats(op);
+	if (stats) {
+		add_op_stats(stats, region);
+	}
+	for (size_t i = 0; i < region->site_count; i++) {
+		add_site_stats(&region->sites[i]);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	clear_arena_stats(region);
+}
+
+static int
+compare_sites(const void *a, const void *b)
+{
+	const arena_site *x = a, *y = b;
+	if (x->bytes != y->bytes) {
+		return x->bytes < y->bytes ? 1 : -1;
+	}
+	return x->allocations < y->allocations   ? 1
+	       : x->allocations > y->allocations ? -1
+						 : 0;
+}
+
+char *
+format_arena_stats(size_t *size)
+{
+	char *text = NULL;
+	FILE *stream = open_memstream(&text, size);
+	if (!stream) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	fprintf(stream, "%-20s %10s %14s %12s %8s %12s %10s\n", "op",
+		"count", "bytes", "allocations", "chunks", "destructors",
+		"max bytes");
+	for (size_t i = 0; i < op_stats_count; i++) {
+		const struct op_stats *stats = &op_stats[i];
+		fprintf(stream, "%-20s %10zu %14zu %12zu %8zu %12zu %10zu\n",
+			stats->op, stats->operations, stats->bytes,
+			stats->allocations, stats->new_chunks,
+			stats->destructors, stats->max_bytes);
+	}
+
+	fprintf(stream, "\nOperations by bytes allocated\n%-20s", "op");
+	for (size_t b = 0; b < ARENA_HISTOGRAM_BUCKETS; b++) {
+		size_t limit = (size_t)256 << b;
+		char label[16];
+		if (b == ARENA_HISTOGRAM_BUCKETS - 1) {
+			snprintf(label, sizeof(label), "more");
+		}
+		else if (limit < 1024) {
+			snprintf(label, sizeof(label), "<%zu", limit);
+		}
+		else {
+			snprintf(label, sizeof(label), "<%zuK", limit / 1024);
+		}
+		fprintf(stream, " %6s", label);
+	}
+	fputc('\n', stream);
+	for (size_t i = 0; i < op_stats_count; i++) {
+		fprintf(stream, "%-20s", op_stats[i].op);
+		for (size_t b = 0; b < ARENA_HISTOGRAM_BUCKETS; b++) {
+			fprintf(stream, " %6zu", op_stats[i].histogram[b]);
+		}
+		fputc('\n', stream);
+	}
+
+	arena_site sites[ARENA_MAX_SITES];
+	size_t count = site_stats_count;
+	memcpy(sites, site_stats, count * sizeof(arena_site));
+	pthread_mutex_unlock(&stats_lock);
+
+	qsort(sites, count, sizeof(arena_site), compare_sites);
+	fprintf(stream, "\nTop allocation sites\n%-32s %12s %14s\n", "site",
+		"allocations", "bytes");
+	for (size_t i = 0; i < count && i < ARENA_TOP_SITES; i++) {
+		fprintf(stream, "%-32s %12zu %14zu\n", sites[i].name,
+			sites[i].allocations, sites[i].bytes);
+	}
+
+	if (fclose(stream) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+static void
+free_registered(arena *region)
+{
+	for (memory_block *block = region->head; block; block = block->next) {
+		block->free_func(block->ptr);
+	}
+	region->head = NULL;
+}
+
+void
+reset_arena(arena *region)
+{
+	record_arena_stats(region);
+	free_registered(region);
+	for (arena_chunk *chunk = region->chunks; chunk; chunk = chunk->next) {
+		chunk->used = 0;
+	}
+	region->current = region->chunks;
+}
+
 void
 free_all(arena *region)
 {
 	if (!region)
 		return;
-	memory_block *block = region->head;
-	while (block) {
-		memory_block *next = block->next;
-		if (block->free_func)
-			block->free_func(block->ptr);
-		free(block);
-		block = next;
+	record_arena_stats(region);
+	free_registered(region);
+	// The first chunk is part of the arena allocation
+	arena_chunk *chunk = region->chunks->next;
+	while (chunk) {
+		arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
-	region->head = NULL;
 	free(region);
 }
 
+void
+trim_arena(arena *region, size_t max_size)
+{
+	assert(region->current == region->chunks);
+	arena_chunk *chunk = region->chunks;
+	size_t kept = chunk->size;
+	while (chunk->next) {
+		arena_chunk *next = chunk->next;
+		if (kept + next->size <= max_size) {
+			kept += next->size;
+			chunk = next;
+			continue;
+		}
+		chunk->next = next->next;
+		free(next);
+	}
+}
+
+static void
+create_thread_arena_key(void)
+{
+	int res = pthread_key_create(&thread_arena_key, (void *)free_all);
+	assert(res == 0);
+}
+
+arena *
+acquire_thread_arena(const char *op)
+{
+	// Nested operations get an arena of their own
+	if (thread_arena_in_use) {
+		arena *region = create_arena();
+		region->op = op;
+		return region;
+	}
+	if (!thread_arena) {
+		pthread_once(&thread_arena_once, create_thread_arena_key);
+		thread_arena = create_arena();
+		pthread_setspecific(thread_arena_key, thread_arena);
+	}
+	thread_arena_in_use = true;
+	thread_arena->op = op;
+	return thread_arena;
+}
+
+void
+release_thread_arena(arena *region)
+{
+	if (region != thread_arena) {
+		free_all(region);
+		return;
+	}
+	reset_arena(region);
+	trim_arena(region, ARENA_HIGH_WATER_MARK);
+	thread_arena_in_use = false;
+}
+
 // String functions
 char *
-rstrdup(arena *region, const char *str)
+rstrdup_at(arena *region, const char *str, const char *site)
 {
-	char *copy = xstrdup(str);
-	arena_register(region, copy, free);
-	return copy;
+	return rstrndup_at(region, str, strlen(str), site);
 }
 
 char *
-rstrins(arena *region, const char *str, size_t offset, const char *buf,
-	size_t size)
+rstrins_at(arena *region, const char *str, size_t offset, const char *buf,
+	   size_t size, const char *site)
 {
 	size_t str_len = strlen(str);
 
 	size_t previous_new_len = (offset <= str_len) ? offset : str_len;
 
-	char *result = NULL;
-	size_t result_len = 0;
-
-	FILE *stream = open_memstream(&result, &result_len);
-	assert(stream);
-
-	fwrite(str, 1, previous_new_len, stream);
-	fwrite(buf, 1, size, stream);
-
-	fclose(stream);
-
-	arena_register(region, result, free);
+	char *result = rmalloc_at(region, previous_new_len + size + 1, site);
+	memcpy(result, str, previous_new_len);
+	memcpy(result + previous_new_len, buf, size);
+	result[previous_new_len + size] = '\0';
 
 	return result;
 }
 
 int
-rasprintf(arena *region, char **strp, const char *fmt, ...)
+rasprintf_at(arena *region, const char *site, char **strp, const char *fmt,
+	     ...)
 {
 	// Calculate length
 	va_list args;
@@ -110,7 +483,7 @@ rasprintf(arena *region, char **strp, const char *fmt, ...)
 		return -1;
 	}
 
-	char *buffer = rmalloc(region, len + 1);
+	char *buffer = rmalloc_at(region, len + 1, site);
 	va_start(args, fmt);
 	int ret = vsnprintf(buffer, len + 1, fmt, args);
 	va_end(args);
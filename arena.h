@@ -4,49 +4,126 @@
 #include <assert.h>
 #include <libical/ical.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef void (*free_func_t)(void *);
 
+// Objects that are not allocated by the arena, freed with free_func
 typedef struct memory_block {
 	void *ptr;
 	free_func_t free_func;
 	struct memory_block *next;
 } memory_block;
 
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+} arena_chunk;
+
 /*
- * Dynamic arena allocator
+ * Bump-pointer arena allocator
+ *
+ * Memory is handed out from chunks and only released all at once, by
+ * free_all or reset_arena. Objects from other allocators are registered
+ * with their free function instead.
  */
+// Allocations made by one function
+typedef struct arena_site {
+	const char *name;
+	size_t allocations;
+	size_t bytes;
+} arena_site;
+
 typedef struct {
+	// The first chunk is allocated together with the arena
+	arena_chunk *chunks;
+	arena_chunk *current;
 	memory_block *head;
+
+	// Accounting since the last reset, see set_arena_stats_enabled.
+	// The operation is the one that acquired the arena.
+	const char *op;
+	size_t bytes;
+	size_t allocations;
+	size_t new_chunks;
+	size_t destructors;
+	arena_site *sites;
+	size_t site_count;
 } arena;
 
 arena *
 create_arena(void);
 
+// Allocations are tagged with the calling function, for the statistics
+#define arena_register(region, ptr, free_func) \
+	arena_register_at(region, ptr, free_func, __func__)
+#define rmalloc(region, size) rmalloc_at(region, size, __func__)
+#define rstrndup(region, src, len) rstrndup_at(region, src, len, __func__)
+#define rstrdup(region, str) rstrdup_at(region, str, __func__)
+#define rstrins(region, str, offset, buf, size) \
+	rstrins_at(region, str, offset, buf, size, __func__)
+#define rasprintf(region, strp, ...) \
+	rasprintf_at(region, __func__, strp, __VA_ARGS__)
+
 void
-arena_register(arena *region, void *ptr, free_func_t free_func);
+arena_register_at(arena *region, void *ptr, free_func_t free_func,
+		  const char *site);
 
 void *
-rmalloc(arena *region, size_t size);
+rmalloc_at(arena *region, size_t size, const char *site);
+
+// Frees registered objects but keeps the chunks to allocate from again
+void
+reset_arena(arena *region);
 
 void
 free_all(arena *region);
 
+// Frees chunks beyond the first max_size bytes, once the arena is reset
+void
+trim_arena(arena *region, size_t max_size);
+
+// The arena of the calling thread, for one operation at a time. It is
+// reset rather than freed by release_thread_arena, and freed when the
+// thread exits.
+arena *
+acquire_thread_arena(const char *op);
+
+void
+release_thread_arena(arena *region);
+
+// Counts allocations per operation and per site when enabled. Off by
+// default, as it costs a few branches per allocation.
+void
+set_arena_stats_enabled(bool enabled);
+
+bool
+arena_stats_enabled(void);
+
+// Writes the statistics of all arenas released so far as text, to be
+// freed with free
+char *
+format_arena_stats(size_t *size);
+
 char *
-rstrndup(arena *ar, const char *src, size_t len);
+rstrndup_at(arena *ar, const char *src, size_t len, const char *site);
 
 char *
-rstrins(arena *region, const char *str, size_t offset, const char *buf,
-	size_t size);
+rstrins_at(arena *region, const char *str, size_t offset, const char *buf,
+	   size_t size, const char *site);
 // String functions
 char *
-rstrdup(arena *region, const char *str);
+rstrdup_at(arena *region, const char *str, const char *site);
 
 int
-rasprintf(arena *region, char **strp, const char *fmt, ...);
+rasprintf_at(arena *region, const char *site, char **strp, const char *fmt,
+	     ...);
 
 // iCal functions
 
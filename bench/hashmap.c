@@ -0,0 +1,240 @@
+// Compares the hashmap hash with FNV-1a on vdir names.
+//
+//   build/bench_hashmap [-n names] [-D vdir]
+//
+// Hashes the .ics names of a vdir and its collections, or as many
+// generated UUID names, and prints the time per hash, the keys sharing a
+// 32 bit hash, the keys whose home slot is taken in a table of the size
+// hashmap would use, and the time per hashmap lookup.
+#define _GNU_SOURCE
+#include "../hashmap.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#define ROUNDS 20
+
+struct names {
+	char **names;
+	size_t count;
+	size_t capacity;
+};
+
+static void
+add_name(struct names *names, char *name)
+{
+	if (names->count == names->capacity) {
+		names->capacity = names->capacity ? names->capacity * 2 : 1024;
+		names->names = xreallocarray(names->names, names->capacity,
+					     sizeof(char *));
+	}
+	names->names[names->count++] = name;
+}
+
+// Keys of entries_vdir are relative to the vdir
+static void
+read_names(struct names *names, const char *vdir, const char *collection)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", vdir, collection);
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char *name = NULL;
+		if (*collection) {
+			asprintf(&name, "%s/%s", collection, entry->d_name);
+		}
+		else {
+			name = xstrdup(entry->d_name);
+		}
+
+		if (strstr(entry->d_name, ".ics")) {
+			add_name(names, name);
+		}
+		else if (entry->d_type == DT_DIR && !*collection) {
+			read_names(names, vdir, name);
+			free(name);
+		}
+		else {
+			free(name);
+		}
+	}
+	closedir(dir);
+}
+
+static void
+generate_names(struct names *names, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		uuid_t uuid;
+		char name[64];
+		uuid_generate(uuid);
+		uuid_unparse_lower(uuid, name);
+		strcat(name, ".ics");
+		add_name(names, xstrdup(name));
+	}
+}
+
+static uint32_t
+fnv1a_hash(const char *key)
+{
+	uint32_t hash = 0x811C9DC5;
+	for (const char *c = key; *c; c++) {
+		hash = (hash ^ (unsigned char)*c) * 0x01000193;
+	}
+	return hash;
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compare_hashes(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+report_hash(const char *label, uint32_t (*hash)(const char *),
+	    const struct names *names)
+{
+	uint32_t *hashes = xcalloc(names->count, sizeof(uint32_t));
+	volatile uint32_t sink = 0;
+	double start = now_ns();
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < names->count; i++) {
+			sink ^= hash(names->names[i]);
+		}
+	}
+	double ns = (now_ns() - start) / ((double)ROUNDS * names->count);
+
+	// The table size hashmap grows to for this many keys
+	size_t capacity = HM_DEFAULT_HASHMAP_SIZE;
+	while ((float)names->count > HM_HASHMAP_MAX_LOAD * (float)capacity) {
+		capacity *= HM_RESIZE_SCALE_FACTOR;
+	}
+	unsigned char *taken = xcalloc(capacity, 1);
+	size_t slot_collisions = 0;
+	for (size_t i = 0; i < names->count; i++) {
+		hashes[i] = hash(names->names[i]);
+		size_t slot = hashes[i] & (capacity - 1);
+		slot_collisions += taken[slot];
+		taken[slot] = 1;
+	}
+
+	qsort(hashes, names->count, sizeof(uint32_t), compare_hashes);
+	size_t hash_collisions = 0;
+	for (size_t i = 1; i < names->count; i++) {
+		hash_collisions += hashes[i] == hashes[i - 1];
+	}
+
+	printf("%-10s %8.1f ns/hash %8zu same hash %8zu taken home slot "
+	       "of %zu\n",
+	       label, ns, hash_collisions, slot_collisions, capacity);
+	free(taken);
+	free(hashes);
+}
+
+static void
+report_lookups(const struct names *names)
+{
+	struct hashmap *map = hashmap_new(NULL);
+	double start = now_ns();
+	for (size_t i = 0; i < names->count; i++) {
+		hashmap_insert(map, names->names[i], names->names[i]);
+	}
+	double insert_ns = (now_ns() - start) / names->count;
+
+	size_t found = 0;
+	start = now_ns();
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < names->count; i++) {
+			found += hashmap_get(map, names->names[i]) != NULL;
+		}
+	}
+	double hit_ns = (now_ns() - start) / ((double)ROUNDS * names->count);
+
+	// Same length as the names, but not in the map
+	start = now_ns();
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < names->count; i++) {
+			char *name = names->names[i];
+			name[0] ^= 0x80;
+			found += hashmap_get(map, name) != NULL;
+			name[0] ^= 0x80;
+		}
+	}
+	double miss_ns = (now_ns() - start) / ((double)ROUNDS * names->count);
+
+	printf("hashmap    %8.1f ns/insert %6.1f ns/hit %6.1f ns/miss "
+	       "(%zu found)\n",
+	       insert_ns, hit_ns, miss_ns, found / ROUNDS);
+	hashmap_free(map);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t count = 100000;
+	const char *vdir = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:D:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			vdir = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n names] [-D vdir]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	struct names names = {0};
+	if (vdir) {
+		read_names(&names, vdir, "");
+	}
+	else {
+		generate_names(&names, count);
+	}
+	if (names.count == 0) {
+		fprintf(stderr, "No names to hash\n");
+		return 1;
+	}
+
+	// Seeds hashmap_hash
+	hashmap_free(hashmap_new(NULL));
+
+	printf("%zu names\n", names.count);
+	report_hash("fnv1a", fnv1a_hash, &names);
+	report_hash("hashmap", hashmap_hash, &names);
+	report_lookups(&names);
+
+	for (size_t i = 0; i < names.count; i++) {
+		free(names.names[i]);
+	}
+	free(names.names);
+	return 0;
+}
@@ -0,0 +1,339 @@
+// Measures how long loading a vdir takes, for 1k to 100k notes.
+//
+//   build/bench_startup [-n notes] [-d depth] [-u duplicate %]
+//                       [-s description bytes] [-t threads] [-i]
+//                       [-D dir] [-k]
+//
+// Generates a vdir of journal entries, loads it with load_root_node_tree
+// and prints the time of each phase, the peak RSS, the number of heap
+// allocations made while loading and the heap kept per note. Entries
+// form a tree of the given depth, a share of them are called "Daily
+// note" to exercise duplicate names, and description sizes vary around
+// the given mean.
+//
+// -D loads an existing vdir, or keeps the generated one there. With -i
+// the index of the previous run is used and updated, so running twice
+// with -D and -i measures a remount.
+#define _GNU_SOURCE
+#include "../fuse_node_store.h"
+#include "../vdir_load.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Heap in use, including large blocks that are mapped separately
+static size_t
+heap_in_use(void)
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+// Counts every heap allocation in the process, libical's included
+extern void *
+__libc_malloc(size_t size);
+extern void *
+__libc_calloc(size_t n, size_t size);
+extern void *
+__libc_realloc(void *ptr, size_t size);
+
+static atomic_size_t allocations = 0;
+
+void *
+malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (!ptr) {
+		atomic_fetch_add_explicit(&allocations, 1,
+					  memory_order_relaxed);
+	}
+	return __libc_realloc(ptr, size);
+}
+
+struct bench_options {
+	size_t notes;
+	size_t depth;
+	unsigned duplicate_percent;
+	size_t description_size;
+	size_t threads;
+	bool use_index;
+	bool keep;
+	const char *dir;
+};
+
+// Deterministic, so runs of the same size are comparable
+static uint64_t rng_state = 0x9E3779B97F4A7C15;
+
+static uint64_t
+next_random(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+// Roughly bell shaped around mean, between 0 and twice the mean
+static size_t
+random_size(size_t mean)
+{
+	if (mean == 0) {
+		return 0;
+	}
+	uint64_t sum = 0;
+	for (int i = 0; i < 4; i++) {
+		sum += next_random() % (mean + 1);
+	}
+	return sum / 2;
+}
+
+// Entries are numbered breadth first, so the parent of i is
+// (i - 1) / branching, with a branching that gives the requested depth
+static size_t
+get_branching(size_t notes, size_t depth)
+{
+	if (depth == 0) {
+		return 0;
+	}
+	size_t branching = 2;
+	while (true) {
+		size_t reachable = 1, level = 1;
+		for (size_t d = 0; d < depth; d++) {
+			level *= branching;
+			reachable += level;
+		}
+		if (reachable >= notes) {
+			return branching;
+		}
+		branching++;
+	}
+}
+
+// Writes a content line folded at 75 octets
+static void
+write_folded(FILE *file, const char *line, size_t len)
+{
+	size_t width = 75;
+	for (size_t pos = 0; pos < len; pos += width) {
+		if (pos > 0) {
+			fputs(" ", file);
+			width = 74;
+		}
+		size_t chunk = len - pos < width ? len - pos : width;
+		fwrite(line + pos, 1, chunk, file);
+		fputs("\r\n", file);
+	}
+}
+
+static int
+generate_entry(const struct bench_options *opts, size_t i, size_t branching,
+	       char *description)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/bench-%08zu.ics", opts->dir, i);
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		return -1;
+	}
+
+	fputs("BEGIN:VCALENDAR\r\nVERSION:2.0\r\n"
+	      "PRODID:-//agendafs//bench//EN\r\nBEGIN:VJOURNAL\r\n",
+	      file);
+	fprintf(file, "UID:bench-%08zu\r\n", i);
+	if (next_random() % 100 < opts->duplicate_percent) {
+		fputs("SUMMARY:Daily note\r\n", file);
+	}
+	else {
+		fprintf(file, "SUMMARY:Note %zu\r\n", i);
+	}
+	fputs("X-CALDAVFS-FILEEXT:md\r\n", file);
+
+	if (branching && i > 0) {
+		fprintf(file, "RELATED-TO;RELTYPE=PARENT:bench-%08zu\r\n",
+			(i - 1) / branching);
+	}
+	if (branching && i * branching + 1 < opts->notes) {
+		fputs("X-CALDAVFS-ISDIRECTORY:YES\r\n", file);
+	}
+
+	size_t size = random_size(opts->description_size);
+	memcpy(description, "DESCRIPTION:", 12);
+	for (size_t c = 0; c < size; c++) {
+		uint64_t r = next_random() % 64;
+		description[12 + c] = r < 10 ? ' ' : 'a' + r % 26;
+	}
+	write_folded(file, description, 12 + size);
+
+	fputs("END:VJOURNAL\r\nEND:VCALENDAR\r\n", file);
+	return fclose(file);
+}
+
+static int
+generate_vdir(const struct bench_options *opts)
+{
+	size_t branching = get_branching(opts->notes, opts->depth);
+	char *description = malloc(12 + opts->description_size * 2 + 1);
+	for (size_t i = 0; i < opts->notes; i++) {
+		if (generate_entry(opts, i, branching, description) != 0) {
+			perror("generate");
+			free(description);
+			return -1;
+		}
+	}
+	free(description);
+	return 0;
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int flag,
+	     struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static bool
+is_empty_dir(const char *dir)
+{
+	struct stat st;
+	if (stat(dir, &st) != 0) {
+		return true;
+	}
+	char probe[4096];
+	snprintf(probe, sizeof(probe), "%s/bench-%08d.ics", dir, 0);
+	return access(probe, F_OK) != 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n notes] [-d depth] [-u duplicate %%] "
+		"[-s description bytes] [-t threads] [-i] [-D dir] [-k]\n",
+		name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_options opts = {
+	    .notes = 1000,
+	    .depth = 0,
+	    .duplicate_percent = 10,
+	    .description_size = 1024,
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:u:s:t:iD:k")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.notes = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			opts.depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			opts.duplicate_percent = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			opts.description_size = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			opts.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			opts.use_index = true;
+			break;
+		case 'D':
+			opts.dir = optarg;
+			opts.keep = true;
+			break;
+		case 'k':
+			opts.keep = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	char tmp_dir[] = "/tmp/agendafs-bench-XXXXXX";
+	if (!opts.dir) {
+		if (!mkdtemp(tmp_dir)) {
+			perror("mkdtemp");
+			return 1;
+		}
+		opts.dir = tmp_dir;
+	}
+	else if (mkdir(opts.dir, 0700) != 0 && errno != EEXIST) {
+		perror("mkdir");
+		return 1;
+	}
+
+	if (is_empty_dir(opts.dir) && generate_vdir(&opts) != 0) {
+		return 1;
+	}
+
+	set_vdir(opts.dir);
+	set_startup_threads(opts.threads);
+	set_vdir_index_enabled(opts.use_index);
+
+	size_t allocations_before = atomic_load(&allocations);
+	size_t heap_before = heap_in_use();
+	struct load_stats stats;
+	load_root_node_tree(&stats);
+	size_t load_allocations =
+	    atomic_load(&allocations) - allocations_before;
+	// What stays allocated for the tree, once loading is done
+	double heap_per_note =
+	    stats.entries ? (double)(heap_in_use() - heap_before) /
+				stats.entries
+			  : 0;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("notes %zu depth %zu duplicates %u%% description %zu B\n",
+	       opts.notes, opts.depth, opts.duplicate_percent,
+	       opts.description_size);
+	printf("  loaded   %zu of %zu files, %zu from the index, %zu "
+	       "threads\n",
+	       stats.entries, stats.files, stats.indexed, stats.threads);
+	printf("  total    %10.1f ms\n", stats.total_ms);
+	printf("  scan     %10.1f ms\n", stats.scan_ms);
+	printf("  read     %10.1f ms (all threads)\n", stats.read_ms);
+	printf("  parse    %10.1f ms (all threads)\n", stats.parse_ms);
+	printf("  merge    %10.1f ms\n", stats.merge_ms);
+	printf("  link     %10.1f ms\n", stats.link_ms);
+	printf("  dedupe   %10.1f ms\n", stats.dedupe_ms);
+	printf("  peak rss %10.1f MiB\n", usage.ru_maxrss / 1024.0);
+	printf("  allocs   %10zu\n", load_allocations);
+	printf("  heap     %10.1f B/note\n", heap_per_note);
+
+	if (!opts.keep) {
+		nftw(opts.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+	return 0;
+}
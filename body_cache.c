@@ -0,0 +1,180 @@
+#include "body_cache.h"
+#include "hashmap.h"
+#include "intern.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cached_body {
+	// Interned, also the key in bodies
+	const char *filename_vdir;
+	struct vdir_fingerprint fp;
+	char *body;
+	size_t size;
+
+	// Most recently used first
+	struct cached_body *prev;
+	struct cached_body *next;
+};
+
+static size_t budget = BODY_CACHE_DEFAULT_BUDGET;
+static size_t used = 0;
+static struct hashmap *bodies = NULL;
+static struct cached_body *lru_head = NULL;
+static struct cached_body *lru_tail = NULL;
+// Reads run in parallel under the read lock of the tree
+static pthread_mutex_t body_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+set_body_cache_budget(size_t bytes)
+{
+	budget = bytes;
+}
+
+static void
+lru_unlink(struct cached_body *cached)
+{
+	if (cached->prev) {
+		cached->prev->next = cached->next;
+	}
+	else {
+		lru_head = cached->next;
+	}
+	if (cached->next) {
+		cached->next->prev = cached->prev;
+	}
+	else {
+		lru_tail = cached->prev;
+	}
+	cached->prev = NULL;
+	cached->next = NULL;
+}
+
+static void
+lru_push_front(struct cached_body *cached)
+{
+	cached->next = lru_head;
+	if (lru_head) {
+		lru_head->prev = cached;
+	}
+	lru_head = cached;
+	if (!lru_tail) {
+		lru_tail = cached;
+	}
+}
+
+static void
+evict(struct cached_body *cached)
+{
+	lru_unlink(cached);
+	hashmap_remove(bodies, cached->filename_vdir);
+	used -= cached->size;
+	release_interned(cached->filename_vdir);
+	free(cached->body);
+	free(cached);
+}
+
+ssize_t
+body_cache_read(const char *filename_vdir, const struct vdir_fingerprint *fp,
+		char *buf, size_t size, off_t offset)
+{
+	ssize_t copied = -1;
+
+	pthread_mutex_lock(&body_cache_lock);
+	struct cached_body *cached = hashmap_get(bodies, filename_vdir);
+	if (cached && vdir_fingerprint_equal(&cached->fp, fp)) {
+		copied = 0;
+		if ((size_t)offset < cached->size) {
+			copied = cached->size - offset;
+			if ((size_t)copied > size) {
+				copied = size;
+			}
+			memcpy(buf, cached->body + offset, copied);
+		}
+		lru_unlink(cached);
+		lru_push_front(cached);
+	}
+	pthread_mutex_unlock(&body_cache_lock);
+
+	return copied;
+}
+
+void
+body_cache_store(const char *filename_vdir, const struct vdir_fingerprint *fp,
+		 const char *body)
+{
+	size_t size = body ? strlen(body) : 0;
+	// A single body larger than the budget would evict everything else
+	if (budget == 0 || size > budget) {
+		body_cache_forget(filename_vdir);
+		return;
+	}
+
+	struct cached_body *cached = xcalloc(1, sizeof(struct cached_body));
+	cached->filename_vdir = intern(filename_vdir);
+	cached->fp = *fp;
+	cached->body = xmalloc(size + 1);
+	memcpy(cached->body, body ? body : "", size + 1);
+	cached->size = size;
+
+	pthread_mutex_lock(&body_cache_lock);
+	if (!bodies) {
+		bodies = hashmap_new_borrowing(NULL);
+	}
+	struct cached_body *old = hashmap_get(bodies, filename_vdir);
+	if (old) {
+		evict(old);
+	}
+	while (lru_tail && used + size > budget) {
+		evict(lru_tail);
+	}
+
+	hashmap_insert(bodies, cached->filename_vdir, cached);
+	lru_push_front(cached);
+	used += size;
+	pthread_mutex_unlock(&body_cache_lock);
+}
+
+void
+body_cache_forget(const char *filename_vdir)
+{
+	pthread_mutex_lock(&body_cache_lock);
+	struct cached_body *cached = hashmap_get(bodies, filename_vdir);
+	if (cached) {
+		evict(cached);
+	}
+	pthread_mutex_unlock(&body_cache_lock);
+}
+
+int
+parse_size(const char *str, size_t *bytes)
+{
+	char *end;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (end == str) {
+		return -1;
+	}
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		value *= 1024;
+		// fall through
+	case 'M':
+	case 'm':
+		value *= 1024;
+		// fall through
+	case 'K':
+	case 'k':
+		value *= 1024;
+		end++;
+		break;
+	}
+
+	if (*end != '\0') {
+		return -1;
+	}
+	*bytes = value;
+	return 0;
+}
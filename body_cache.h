@@ -0,0 +1,36 @@
+#ifndef body_cache_h_INCLUDED
+#define body_cache_h_INCLUDED
+#include "fuse_node_store.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+// Descriptions of recently read or written entries, so reading a note in
+// chunks parses it once. Entries are only used while the fingerprint of
+// their vdir file matches, and the least recently used ones are evicted
+// once the cache grows past its budget.
+
+#define BODY_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+// 0 disables the cache
+void
+set_body_cache_budget(size_t bytes);
+
+// Copies up to size bytes at offset into buf. Returns the number of
+// bytes copied, or -1 if the body of this version is not cached.
+ssize_t
+body_cache_read(const char *filename_vdir, const struct vdir_fingerprint *fp,
+		char *buf, size_t size, off_t offset);
+
+// body may be NULL for an entry without description
+void
+body_cache_store(const char *filename_vdir, const struct vdir_fingerprint *fp,
+		 const char *body);
+
+void
+body_cache_forget(const char *filename_vdir);
+
+// Parses sizes like 512K, 64M or 1G
+int
+parse_size(const char *str, size_t *bytes);
+
+#endif // body_cache_h_INCLUDED
@@ -0,0 +1,177 @@
+#include "change_hook.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+extern char **environ;
+
+static char *hook_cmd = NULL;
+static unsigned long hook_delay_ms = 0;
+
+static pthread_t hook_thread;
+static pthread_mutex_t hook_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hook_cond;
+// A write happened since the hook last started
+static bool hook_pending = false;
+static bool hook_stopping = false;
+static struct timespec last_change;
+
+int
+parse_duration_ms(const char *str, unsigned long *ms)
+{
+	char *unit = NULL;
+	errno = 0;
+	unsigned long value = strtoul(str, &unit, 10);
+	if (errno != 0 || unit == str) {
+		return -1;
+	}
+
+	if (strcmp(unit, "") == 0 || strcmp(unit, "s") == 0) {
+		*ms = value * 1000;
+	}
+	else if (strcmp(unit, "ms") == 0) {
+		*ms = value;
+	}
+	else if (strcmp(unit, "m") == 0) {
+		*ms = value * 60 * 1000;
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+static struct timespec
+add_ms(struct timespec t, unsigned long ms)
+{
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (ms % 1000) * 1000000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000;
+	}
+	return t;
+}
+
+static bool
+is_before(struct timespec a, struct timespec b)
+{
+	return a.tv_sec < b.tv_sec ||
+	       (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static void
+run_hook()
+{
+	LOG("Running %s", hook_cmd);
+	char *argv[] = {"sh", "-c", hook_cmd, NULL};
+	pid_t pid;
+	int res = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ);
+	if (res != 0) {
+		fprintf(stderr, "Failed to run on_change: %s\n", strerror(res));
+		return;
+	}
+
+	int wstatus;
+	while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR)
+		;
+	if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0) {
+		fprintf(stderr, "on_change exited with %d\n",
+			WEXITSTATUS(wstatus));
+	}
+}
+
+static void *
+hook_loop(void *arg)
+{
+	pthread_mutex_lock(&hook_lock);
+	while (!hook_stopping) {
+		if (!hook_pending) {
+			pthread_cond_wait(&hook_cond, &hook_lock);
+			continue;
+		}
+
+		// Every write pushes the deadline further out
+		struct timespec deadline = add_ms(last_change, hook_delay_ms);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (is_before(now, deadline)) {
+			pthread_cond_timedwait(&hook_cond, &hook_lock,
+					       &deadline);
+			continue;
+		}
+
+		hook_pending = false;
+		pthread_mutex_unlock(&hook_lock);
+		run_hook();
+		pthread_mutex_lock(&hook_lock);
+	}
+
+	bool flush = hook_pending;
+	hook_pending = false;
+	pthread_mutex_unlock(&hook_lock);
+
+	if (flush) {
+		run_hook();
+	}
+	return NULL;
+}
+
+int
+start_change_hook(const char *cmd, unsigned long delay_ms)
+{
+	hook_cmd = xstrdup(cmd);
+	hook_delay_ms = delay_ms;
+
+	// Deadlines must not jump with the wall clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&hook_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&hook_thread, NULL, hook_loop, NULL) != 0) {
+		free(hook_cmd);
+		hook_cmd = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+notify_change_hook()
+{
+	if (!hook_cmd) {
+		return;
+	}
+
+	pthread_mutex_lock(&hook_lock);
+	hook_pending = true;
+	clock_gettime(CLOCK_MONOTONIC, &last_change);
+	pthread_cond_signal(&hook_cond);
+	pthread_mutex_unlock(&hook_lock);
+}
+
+void
+stop_change_hook()
+{
+	if (!hook_cmd) {
+		return;
+	}
+
+	pthread_mutex_lock(&hook_lock);
+	hook_stopping = true;
+	pthread_cond_signal(&hook_cond);
+	pthread_mutex_unlock(&hook_lock);
+
+	pthread_join(hook_thread, NULL);
+	free(hook_cmd);
+	hook_cmd = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef change_hook_h_INCLUDED
+#define change_hook_h_INCLUDED
+#include <stdbool.h>
+
+// Parses durations like 5s, 500ms or 2m. Plain numbers are seconds.
+int
+parse_duration_ms(const char *str, unsigned long *ms);
+
+// Runs cmd with /bin/sh once no write happened for delay_ms. Writes
+// during a run cause exactly one more run afterwards.
+int
+start_change_hook(const char *cmd, unsigned long delay_ms);
+
+// Called after every write to the vdir. Does nothing without a hook.
+void
+notify_change_hook();
+
+// Runs a pending hook right away and stops the hook thread
+void
+stop_change_hook();
+
+#endif // change_hook_h_INCLUDED
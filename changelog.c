@@ -0,0 +1,163 @@
+#include "changelog.h"
+#include "util.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct change_record {
+	uint64_t seq;
+	// Formatted, newline terminated line
+	char *line;
+	size_t len;
+};
+
+static struct change_record records[CHANGELOG_CAPACITY];
+// Sequence numbers start at 1, so a cursor at 0 has read nothing
+static uint64_t last_seq = 0;
+static pthread_mutex_t changelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*changelog_notify)(void) = NULL;
+
+static const char *
+format_change_type(enum change_type type)
+{
+	switch (type) {
+	case CHANGE_CREATE:
+		return "create";
+	case CHANGE_MODIFY:
+		return "modify";
+	case CHANGE_RENAME:
+		return "rename";
+	case CHANGE_DELETE:
+		return "delete";
+	}
+	return "unknown";
+}
+
+// Fields are tab separated, so tabs, newlines and backslashes in paths
+// are escaped.
+static void
+print_escaped(FILE *stream, const char *str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+		case '\t':
+			fputs("\\t", stream);
+			break;
+		case '\n':
+			fputs("\\n", stream);
+			break;
+		case '\\':
+			fputs("\\\\", stream);
+			break;
+		default:
+			fputc(*str, stream);
+		}
+	}
+}
+
+static uint64_t
+oldest_seq()
+{
+	return last_seq > CHANGELOG_CAPACITY ? last_seq - CHANGELOG_CAPACITY + 1
+					     : 1;
+}
+
+void
+changelog_record(enum change_type type, const char *uid, const char *path,
+		 const char *old_path)
+{
+	pthread_mutex_lock(&changelog_lock);
+	uint64_t seq = ++last_seq;
+
+	char *line = NULL;
+	size_t len = 0;
+	FILE *stream = open_memstream(&line, &len);
+	if (!stream) {
+		exit(1);
+	}
+
+	fprintf(stream, "%" PRIu64 "\t%s\t", seq, format_change_type(type));
+	print_escaped(stream, uid ? uid : "");
+	fputc('\t', stream);
+	print_escaped(stream, path ? path : "");
+	if (type == CHANGE_RENAME && old_path) {
+		fputc('\t', stream);
+		print_escaped(stream, old_path);
+	}
+	fputc('\n', stream);
+	fclose(stream);
+
+	struct change_record *r = &records[seq % CHANGELOG_CAPACITY];
+	free(r->line);
+	r->seq = seq;
+	r->line = line;
+	r->len = len;
+
+	void (*notify)(void) = changelog_notify;
+	pthread_mutex_unlock(&changelog_lock);
+
+	LOG("Change %s", line);
+	if (notify) {
+		notify();
+	}
+}
+
+void
+changelog_set_notify(void (*notify)(void))
+{
+	pthread_mutex_lock(&changelog_lock);
+	changelog_notify = notify;
+	pthread_mutex_unlock(&changelog_lock);
+}
+
+uint64_t
+changelog_last_seq()
+{
+	pthread_mutex_lock(&changelog_lock);
+	uint64_t seq = last_seq;
+	pthread_mutex_unlock(&changelog_lock);
+	return seq;
+}
+
+bool
+changelog_has_unread(const struct changelog_cursor *cursor)
+{
+	return cursor->seq < changelog_last_seq();
+}
+
+size_t
+changelog_read(struct changelog_cursor *cursor, char *buf, size_t size)
+{
+	pthread_mutex_lock(&changelog_lock);
+
+	// Records were overwritten, continue at the oldest one left
+	if (cursor->seq + 1 < oldest_seq()) {
+		cursor->seq = oldest_seq() - 1;
+		cursor->offset = 0;
+	}
+
+	size_t written = 0;
+	while (cursor->seq < last_seq && written < size) {
+		const struct change_record *r =
+		    &records[(cursor->seq + 1) % CHANGELOG_CAPACITY];
+
+		size_t n = r->len - cursor->offset;
+		if (n > size - written) {
+			n = size - written;
+		}
+		memcpy(buf + written, r->line + cursor->offset, n);
+		written += n;
+		cursor->offset += n;
+
+		if (cursor->offset == r->len) {
+			cursor->seq++;
+			cursor->offset = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&changelog_lock);
+	return written;
+}
@@ -0,0 +1,42 @@
+#ifndef changelog_h_INCLUDED
+#define changelog_h_INCLUDED
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Only the most recent records are kept, readers that fall further
+// behind continue at the oldest one.
+#define CHANGELOG_CAPACITY 4096
+
+enum change_type { CHANGE_CREATE, CHANGE_MODIFY, CHANGE_RENAME, CHANGE_DELETE };
+
+// Position of a reader in the change feed
+struct changelog_cursor {
+	// Last record that was read completely
+	uint64_t seq;
+	// Bytes already read of the record after seq
+	size_t offset;
+};
+
+// Appends a record. old_path is only used for renames. Safe to call from
+// any thread.
+void
+changelog_record(enum change_type type, const char *uid, const char *path,
+		 const char *old_path);
+
+// Called after every record, i.e. to wake up pollers
+void
+changelog_set_notify(void (*notify)(void));
+
+uint64_t
+changelog_last_seq();
+
+bool
+changelog_has_unread(const struct changelog_cursor *cursor);
+
+// Copies unread records to buf and advances cursor. Returns the number
+// of bytes copied, 0 when the reader is up to date.
+size_t
+changelog_read(struct changelog_cursor *cursor, char *buf, size_t size);
+
+#endif // changelog_h_INCLUDED
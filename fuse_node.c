@@ -1,5 +1,9 @@
 #include "agenda_entry.h"
 #include "arena.h"
+#include "change_hook.h"
+#include "changelog.h"
+#include "fuse_node.h"
+#include "body_cache.h"
 #include "fuse_node_store.h"
 #include "hashmap.h"
 #include "ical_extra.h"
@@ -24,19 +28,8 @@
 struct tree_node *
 get_node_by_uuid(arena *ar, const char *target_uuid)
 {
-	char *filename_vdir = NULL;
-
-	// Filenames are uid.ics, so we levarage that
-	size_t wRes = rasprintf(ar, &filename_vdir, "%s.ics", target_uuid);
-	assert(wRes != -1);
-
 	LOG("Looking for UID: '%s'", target_uuid);
-	LOG("Full filename: '%s'", filename_vdir);
-
-	struct tree_node *node = get_fuse_node_from_vdir_name(filename_vdir);
-	LOG("Found it: %b", node != NULL);
-
-	return node;
+	return get_fuse_node_from_uid(target_uuid);
 }
 
 struct tree_node *
@@ -47,21 +40,21 @@ get_node_by_path(arena *ar, const char *path)
 		return fuse_root;
 	}
 
-	char *segments[255];
-	size_t count = split_path(ar, path, segments);
-
+	// Segments are compared in place, so lookups do not allocate
 	struct tree_node *current = fuse_root;
+	const char *segment = path + strspn(path, "/");
 
-	for (size_t i = 0; i < count && current; ++i) {
-		const char *segment = segments[i];
+	while (*segment && current) {
+		size_t len = strcspn(segment, "/");
 		struct tree_node *next = NULL;
-		LOG("Segment: %s", segment);
+		LOG("Segment: %.*s", (int)len, segment);
 
 		for (size_t j = 0; j < current->child_count; ++j) {
 
 			const char *child_name =
 			    get_node_filename(current->children[j]);
-			if (strcmp(child_name, segment) == 0) {
+			if (strncmp(child_name, segment, len) == 0 &&
+			    child_name[len] == '\0') {
 
 				next = current->children[j];
 				break;
@@ -71,6 +64,8 @@ get_node_by_path(arena *ar, const char *path)
 			return NULL;
 		}
 		current = next;
+		segment += len;
+		segment += strspn(segment, "/");
 	}
 	return current;
 }
@@ -90,6 +85,14 @@ node_is_directory(arena *ar, const struct tree_node *node,
 	}
 }
 
+static void
+record_node_change(arena *ar, enum change_type type,
+		   const struct tree_node *node, const char *old_path)
+{
+	changelog_record(type, get_entry(node)->uid, get_node_path(ar, node),
+			 old_path);
+}
+
 size_t
 write_ical_file(arena *ar, const struct tree_node *node, icalcomponent *ic)
 {
@@ -117,8 +120,30 @@ write_ical_file(arena *ar, const struct tree_node *node, icalcomponent *ic)
 
 	char *ical_str = ricalcomponent_as_ical_string_r(ar, ic);
 
-	int res = write_to_file(get_vdir_filepath(ar, node), ical_str);
+	const char *filepath = get_vdir_filepath(ar, node);
+	bool exists = access(filepath, F_OK) == 0;
 
+	int res = write_to_file(filepath, ical_str);
+	if (res != 0) {
+		return res;
+	}
+
+	// The watcher gets notified of this write as well
+	struct stat st;
+	if (stat(filepath, &st) == 0) {
+		struct vdir_fingerprint fp = vdir_fingerprint_from_stat(&st);
+		remember_own_vdir_write(get_entry(node)->filename_vdir, &fp);
+		body_cache_store(get_entry(node)->filename_vdir, &fp,
+				 icalcomponent_get_description(inner));
+	}
+
+	struct agenda_entry *entry = node->data;
+	entry->is_directory = is_directory_component(ic);
+	entry->description_size = icalcomponent_get_description_size(inner);
+
+	record_node_change(ar, exists ? CHANGE_MODIFY : CHANGE_CREATE, node,
+			   NULL);
+	notify_change_hook();
 	return res;
 }
 
@@ -176,59 +201,90 @@ update_node_file_extension(arena *ar, icalcomponent *ics,
 }
 
 struct agenda_entry *
-parse_ics_to_agenda_entry(arena *ar, const char *vdir_filepath)
+agenda_entry_from_header(arena *ar, const struct ics_header *header,
+			 const char *filename_vdir)
 {
-	icalcomponent *component = parse_ics_file(ar, vdir_filepath);
-	if (component == NULL) {
-		LOG("No component");
-		return NULL;
-	}
-	icalcomponent *journal =
-	    icalcomponent_get_first_real_component(component);
-
-	if (journal == NULL ||
-	    icalcomponent_isa(journal) != ICAL_VJOURNAL_COMPONENT) {
-		LOG("Not journal component");
-		return NULL;
-	}
-	const char *summary = icalcomponent_get_summary(component);
-	if (summary == NULL) {
+	if (header->summary == NULL) {
 		LOG("No summary found");
 		return NULL;
 	}
 
 	char *filename = NULL;
-	if (is_directory_component(component)) {
-		filename = rstrdup(ar, summary);
+	if (header->is_directory) {
+		filename = rstrdup(ar, header->summary);
 	}
 	else {
-		LOG("GETTING FILE EXT");
-		const char *extension =
-		    icalcomponent_get_file_extension(component);
+		const char *extension = header->file_extension;
 		if (!extension) {
-			LOG("Has none, setting to default");
+			LOG("Has no file extension, setting to default");
 			extension = get_default_file_extension();
 		}
 
 		if (strcmp(extension, "") == 0) {
-			filename = rstrdup(ar, summary);
+			filename = rstrdup(ar, header->summary);
 		}
 		else {
-			rasprintf(ar, &filename, "%s.%s", summary, extension);
+			rasprintf(ar, &filename, "%s.%s", header->summary,
+				  extension);
 		}
 	}
 
-	struct agenda_entry *e =
-	    create_agenda_entry(ar, filename, get_filename(vdir_filepath));
+	// UID is required, but don't lose notes of sloppy clients over it
+	const char *uid = header->uid;
+	if (uid == NULL) {
+		LOG("No uid found");
+		uid = without_file_extension(ar, get_filename(filename_vdir));
+	}
 
-	return e;
+	struct agenda_entry *entry =
+	    create_agenda_entry(ar, filename, filename_vdir, uid);
+	entry->is_directory = header->is_directory;
+	entry->description_size = header->description_size;
+	return entry;
 }
 
-// Owner: arena
-struct agenda_entry *
-load_agenda_entry_from_ics_file(arena *ar, const char *filename)
+struct parsed_entry *
+parsed_entry_from_header(arena *ar, const char *filename_vdir,
+			 const struct ics_header *header,
+			 const struct vdir_fingerprint *fp)
+{
+	struct agenda_entry *entry =
+	    agenda_entry_from_header(ar, header, filename_vdir);
+	if (!entry) {
+		return NULL;
+	}
+
+	struct parsed_entry *parsed = rmalloc(ar, sizeof(struct parsed_entry));
+	parsed->entry = entry;
+	parsed->header = *header;
+	parsed->fp = *fp;
+	return parsed;
+}
+
+static bool
+should_read_vdir_entry(const char *filename_vdir,
+		       const struct vdir_fingerprint *fp)
 {
-	path *filepath = append_path(ar, VDIR, filename);
+	if (is_rejected_vdir_file(filename_vdir, fp)) {
+		LOG("%s is known not to be a journal", filename_vdir);
+		return false;
+	}
+
+	// The tree is already up to date with what agendafs wrote itself
+	if (is_own_vdir_write(filename_vdir, fp)) {
+		LOG("%s was written by us", filename_vdir);
+		return false;
+	}
+	return true;
+}
+
+// Rejected files are remembered by fingerprint, so unchanged ones only
+// cost a stat.
+char *
+read_vdir_entry(arena *ar, const char *filename_vdir,
+		struct vdir_fingerprint *fp)
+{
+	path *filepath = append_path(ar, VDIR, filename_vdir);
 	LOG("Filepath is %s", filepath);
 
 	struct stat fileStat;
@@ -237,99 +293,87 @@ load_agenda_entry_from_ics_file(arena *ar, const char *filename)
 		return NULL;
 	}
 
-	struct agenda_entry *new_entry =
-	    parse_ics_to_agenda_entry(ar, filepath);
-	if (!new_entry) {
-		LOG("Could not parse entry");
+	*fp = vdir_fingerprint_from_stat(&fileStat);
+	if (!should_read_vdir_entry(filename_vdir, fp)) {
 		return NULL;
 	}
 
-	LOG("Parsed %s to file %s", new_entry->filename_vdir,
-	    new_entry->filename);
-	return new_entry;
+	return read_ics_file(ar, filepath, fileStat.st_size);
 }
 
-void
-load_root_node_tree()
+char *
+read_vdir_entry_at(arena *ar, int vdir_fd, const char *filename_vdir,
+		   const struct vdir_fingerprint *fp)
 {
-	entries_vdir = hashmap_new(NULL);
-	fuse_root = create_tree_node(NULL, NULL);
-	arena *ar = create_arena();
-	LOG("Loading journal entries from: %s\n", VDIR);
+	if (!should_read_vdir_entry(filename_vdir, fp)) {
+		return NULL;
+	}
+
+	return read_ics_file_at(ar, vdir_fd, filename_vdir, fp->size);
+}
 
-	DIR *dir = opendir(VDIR);
-	if (!dir) {
-		perror("opendir");
-		return;
+struct parsed_entry *
+parse_vdir_buffer(arena *ar, const char *filename_vdir, const char *buffer,
+		  const struct vdir_fingerprint *fp)
+{
+	size_t len = strlen(buffer);
+	if (!ics_has_vjournal(buffer, len)) {
+		LOG("No VJOURNAL in %s", filename_vdir);
+		reject_vdir_file(filename_vdir, fp);
+		return NULL;
 	}
 
-	struct dirent *entry;
-	while ((entry = readdir(dir))) {
-		if (entry->d_type == DT_UNKNOWN) {
-			printf("Unsupported file type for '%s'. Skipping\n",
-			       entry->d_name);
-		}
-		if (entry->d_type == DT_REG && strstr(entry->d_name, ".ics")) {
-			LOG("Loading %s", entry->d_name);
-			struct agenda_entry *new_entry =
-			    load_agenda_entry_from_ics_file(ar, entry->d_name);
-			if (new_entry) {
-				create_fuse_node(new_entry);
-				LOG("Inserted filename_vdir: %s, %s",
-				    new_entry->filename,
-				    new_entry->filename_vdir);
-			}
-			else {
-				LOG("Skipping %s", entry->d_name);
-			}
-		}
+	struct ics_header header;
+	switch (scan_ics_header(ar, buffer, len, &header)) {
+	case ICS_JOURNAL:
+		break;
+	case ICS_TRUNCATED:
+		// Not rejected, the rest of the file is likely on its way
+		LOG("Journal in %s does not end", filename_vdir);
+		return NULL;
+	case ICS_NOT_JOURNAL:
+		LOG("Not journal component");
+		reject_vdir_file(filename_vdir, fp);
+		return NULL;
 	}
-	closedir(dir);
-	LOG("Set up directories according to parent-child");
-
-	size_t n_keys = 0;
-	char **keys = hashmap_get_keys(entries_vdir, &n_keys);
-	for (size_t i = 0; i < n_keys; i++) {
-		const char *vdirname = keys[i];
-		struct tree_node *child =
-		    get_fuse_node_from_vdir_name(vdirname);
-
-		LOG("Parsing %s", vdirname);
-		icalcomponent *ic = get_icalcomponent_from_node(ar, child);
-		LOG("Success");
-
-		const char *parent_uid = get_parent_uid(ic);
-		if (parent_uid) {
-			LOG("Has parent");
-
-			struct tree_node *parent =
-			    get_node_by_uuid(ar, parent_uid);
-			if (parent) {
-				icalcomponent *pic =
-				    get_icalcomponent_from_node(ar, parent);
-				if (!is_directory_component(pic)) {
-					icalcomponent_mark_as_directory(pic);
-					assert(write_ical_file(ar, parent,
-							       pic) == 0);
-				}
-
-				move_fuse_node(parent, child);
-			}
-			else {
-				LOG("COULD NOT FIND PARENT NODE: %s",
-				    parent_uid);
-			}
-		}
-		else {
-			add_fuse_child(fuse_root, child);
-		}
+
+	struct parsed_entry *parsed =
+	    parsed_entry_from_header(ar, filename_vdir, &header, fp);
+	if (!parsed) {
+		LOG("Could not parse entry");
+		reject_vdir_file(filename_vdir, fp);
+		return NULL;
 	}
-	LOG("Inserted %zu entries", n_keys);
+	return parsed;
+}
 
-	hashmap_free_keys(keys, n_keys);
-	free_all(ar);
+struct parsed_entry *
+parse_vdir_entry(arena *ar, const char *filename_vdir)
+{
+	LOG("Filename original is %s", filename_vdir);
 
-	LOG("Done");
+	struct vdir_fingerprint fp;
+	char *buffer = read_vdir_entry(ar, filename_vdir, &fp);
+	if (!buffer) {
+		return NULL;
+	}
+
+	return parse_vdir_buffer(ar, filename_vdir, buffer, &fp);
+}
+
+// Owner: arena
+struct agenda_entry *
+load_agenda_entry_from_ics_file(arena *ar, const char *filename)
+{
+	struct parsed_entry *parsed = parse_vdir_entry(ar, filename);
+	if (!parsed) {
+		return NULL;
+	}
+
+	struct agenda_entry *new_entry = parsed->entry;
+	LOG("Parsed %s to file %s", new_entry->filename_vdir,
+	    new_entry->filename);
+	return new_entry;
 }
 
 // Sets a validated dtstart
@@ -585,26 +629,30 @@ set_node_status(arena *ar, const struct tree_node *node,
 	return write_ical_file(ar, node, component);
 }
 
+static bool
+entry_is_directory(const struct tree_node *node)
+{
+	return is_root_node(node) || node_has_children(node) ||
+	       get_entry(node)->is_directory;
+}
+
+// Sums the cached sizes of the entries, no file is read
 size_t
-calculate_node_size(arena *ar, const struct tree_node *node,
-		    icalcomponent *node_component)
+calculate_node_size(const struct tree_node *node)
 {
-	if (!node_is_directory(ar, node, node_component)) {
-		return icalcomponent_get_description_size(node_component);
+	if (!entry_is_directory(node)) {
+		return get_entry(node)->description_size;
 	}
 
 	size_t total_size = 0;
-	for (int i = 0; i < node->child_count; i++) {
-		icalcomponent *cic =
-		    get_icalcomponent_from_node(ar, node->children[i]);
-		total_size += calculate_node_size(ar, node->children[i], cic);
+	for (size_t i = 0; i < node->child_count; i++) {
+		total_size += calculate_node_size(node->children[i]);
 	}
 	return total_size;
 }
 
 struct stat
-get_node_stat(arena *ar, const struct tree_node *node,
-	      icalcomponent *node_component)
+get_node_stat(arena *ar, const struct tree_node *node)
 {
 	if (is_root_node(node)) {
 		struct stat st = {0};
@@ -618,17 +666,12 @@ get_node_stat(arena *ar, const struct tree_node *node,
 		const char *vdir_path = get_vdir_filepath(ar, node);
 		int res = stat(vdir_path, &vdir_stat);
 		assert(res == 0);
-		if (node_is_directory(ar, node, node_component)) {
-			vdir_stat.st_size = (off_t)calculate_node_size(
-			    ar, node, node_component);
+		vdir_stat.st_size = (off_t)calculate_node_size(node);
+		if (entry_is_directory(node)) {
 			vdir_stat.st_mode = S_IFDIR | 0444;
 			vdir_stat.st_nlink = 2;
 		}
 		else {
-			vdir_stat.st_size =
-			    (off_t)icalcomponent_get_description_size(
-				node_component);
-
 			vdir_stat.st_mode = S_IFREG | 0774;
 			vdir_stat.st_nlink = 1;
 		}
@@ -659,6 +702,9 @@ insert_fuse_node_to_path(arena *ar, const char *fuse_path,
 		return -ENOTDIR;
 	}
 
+	// Linked first so the change is recorded with the full path
+	add_fuse_child(parent_node, child_node);
+
 	if (parent_ics) {
 		status = write_parent_child_components(
 		    ar, parent_node, parent_ics, child_node, child_ics);
@@ -667,12 +713,9 @@ insert_fuse_node_to_path(arena *ar, const char *fuse_path,
 		write_ical_file(ar, child_node, child_ics);
 	}
 
-	add_child(parent_node, child_node);
 	return status;
 }
 
-enum ENTRY_TYPE { ENTRY_DIRECTORY, ENTRY_FILE };
-
 int
 create_entry_from_fuse(arena *ar, const char *fuse_path, enum ENTRY_TYPE etype)
 {
@@ -684,6 +727,17 @@ create_entry_from_fuse(arena *ar, const char *fuse_path, enum ENTRY_TYPE etype)
 	const char *new_filename = get_filename(fuse_path);
 	icalcomponent *new_component = NULL;
 
+	struct tree_node *parent_node =
+	    get_node_by_path(ar, get_parent_path(ar, fuse_path));
+	if (!parent_node) {
+		return -ENOENT;
+	}
+
+	// Entries are stored next to their parent
+	const char *collection = is_root_node(parent_node)
+				     ? get_default_collection()
+				     : get_node_collection(ar, parent_node);
+
 	switch (etype) {
 	case (ENTRY_DIRECTORY):
 		new_component = create_vjournal_directory(ar, new_filename);
@@ -693,12 +747,15 @@ create_entry_from_fuse(arena *ar, const char *fuse_path, enum ENTRY_TYPE etype)
 		break;
 	}
 
-	char *new_filname_vdir = NULL;
-	rasprintf(ar, &new_filname_vdir, "%s.ics",
+	char *new_filename_ics = NULL;
+	rasprintf(ar, &new_filename_ics, "%s.ics",
 		  icalcomponent_get_uid(new_component));
+	char *new_filname_vdir =
+	    vdir_child_path(ar, collection, new_filename_ics);
 
 	struct agenda_entry *new_entry =
-	    create_agenda_entry(ar, new_filename, new_filname_vdir);
+	    create_agenda_entry(ar, new_filename, new_filname_vdir,
+				icalcomponent_get_uid(new_component));
 
 	LOG("Inserting vjournal directory");
 
@@ -707,36 +764,58 @@ create_entry_from_fuse(arena *ar, const char *fuse_path, enum ENTRY_TYPE etype)
 	return insert_fuse_node_to_path(ar, fuse_path, new_node, new_component);
 }
 
+// Only touches the tree. The vdir file of the parent is only read and
+// written if it has to be marked as a directory, which happens once per
+// parent.
 int
-update_or_create_fuse_entry_from_vdir(arena *ar, const char *filepath_vdir)
+publish_vdir_entry(arena *ar, const struct parsed_entry *parsed)
 {
-	const char *filename_vdir = get_filename(filepath_vdir);
-	LOG("Filename original is %s", filename_vdir);
-
-	struct agenda_entry *updated_entry =
-	    load_agenda_entry_from_ics_file(ar, filename_vdir);
-
-	if (!updated_entry) {
-		return -EIO;
+	const struct agenda_entry *updated_entry = parsed->entry;
+
+	// The file might have been removed or written again while it was
+	// parsed. The event of that change is still queued, and writes of
+	// agendafs itself are in the tree already.
+	path *filepath = append_path(ar, VDIR, updated_entry->filename_vdir);
+	struct stat st;
+	if (stat(filepath, &st) != 0) {
+		LOG("%s disappeared, not publishing", filepath);
+		return -ENOENT;
+	}
+	struct vdir_fingerprint fp = vdir_fingerprint_from_stat(&st);
+	if (!vdir_fingerprint_equal(&fp, &parsed->fp) ||
+	    is_own_vdir_write(updated_entry->filename_vdir, &fp)) {
+		LOG("%s changed since it was read, not publishing", filepath);
+		return -EAGAIN;
 	}
 
-	struct tree_node *node = upsert_fuse_node(updated_entry);
-
-	icalcomponent *entry_ics = get_icalcomponent_from_node(ar, node);
+	struct tree_node *existing =
+	    get_fuse_node_from_vdir_name(updated_entry->filename_vdir);
+	const char *old_path = existing ? get_node_path(ar, existing) : NULL;
 
-	const char *new_parent_uid = get_parent_uid(entry_ics);
+	struct tree_node *node = upsert_fuse_node(updated_entry);
 
-	if (new_parent_uid) {
+	struct tree_node *new_parent = NULL;
+	if (parsed->header.parent_uid) {
 		LOG("Has parent");
-		struct tree_node *new_parent =
-		    get_node_by_uuid(ar, new_parent_uid);
+		new_parent = get_node_by_uuid(ar, parsed->header.parent_uid);
+	}
+
+	if (new_parent) {
 		move_fuse_node(new_parent, node);
 
-		icalcomponent *pic =
-		    get_icalcomponent_from_node(ar, new_parent);
-		if (!is_directory_component(pic)) {
-			icalcomponent_mark_as_directory(pic);
-			assert(write_ical_file(ar, new_parent, pic) == 0);
+		struct agenda_entry *parent_entry = new_parent->data;
+		if (!parent_entry->is_directory) {
+			icalcomponent *pic =
+			    get_icalcomponent_from_node(ar, new_parent);
+			if (is_directory_component(pic)) {
+				parent_entry->is_directory = true;
+			}
+			else {
+				// Sets is_directory as well
+				icalcomponent_mark_as_directory(pic);
+				assert(write_ical_file(ar, new_parent, pic) ==
+				       0);
+			}
 		}
 	}
 	else {
@@ -744,10 +823,32 @@ update_or_create_fuse_entry_from_vdir(arena *ar, const char *filepath_vdir)
 		move_fuse_node(fuse_root, node);
 	}
 
+	const char *new_path = get_node_path(ar, node);
+	if (!old_path) {
+		record_node_change(ar, CHANGE_CREATE, node, NULL);
+	}
+	else if (strcmp(old_path, new_path) != 0) {
+		record_node_change(ar, CHANGE_RENAME, node, old_path);
+	}
+	else {
+		record_node_change(ar, CHANGE_MODIFY, node, NULL);
+	}
+
 	LOG("Tree updated");
 	return 0;
 }
 
+int
+update_or_create_fuse_entry_from_vdir(arena *ar, const char *filename_vdir)
+{
+	struct parsed_entry *parsed = parse_vdir_entry(ar, filename_vdir);
+	if (!parsed) {
+		return -EIO;
+	}
+
+	return publish_vdir_entry(ar, parsed);
+}
+
 int
 do_agenda_rename(arena *ar, const char *old, const char *new)
 {
@@ -778,23 +879,27 @@ do_agenda_rename(arena *ar, const char *old, const char *new)
 	icalcomponent *old_parent_ics =
 	    get_icalcomponent_from_node(ar, old_parent_node);
 
+	const char *old_path = get_node_path(ar, child_node);
+
 	set_node_filename(child_node, new_filename);
-	update_summary(ar, child_ics, child_node);
-	update_node_file_extension(ar, child_ics, child_node);
+	move_fuse_node(new_parent_ics ? new_parent_node : fuse_root,
+		       child_node);
+	record_node_change(ar, CHANGE_RENAME, child_node, old_path);
 
+	// The relationship is updated before writing, so that a move to the
+	// root is stored as well.
 	if (old_parent_node && old_parent_ics) {
 		remove_parent_child_relationship_from_component(old_parent_ics,
 								child_ics);
 	}
 
 	if (new_parent_ics) {
-		move_node(new_parent_node, child_node);
-		write_parent_child_components(
-		    ar, new_parent_node, new_parent_ics, child_node, child_ics);
-	}
-	else {
-		move_node(fuse_root, child_node);
+		set_parent_child_relationship_to_component(new_parent_ics,
+							   child_ics);
 	}
+
+	update_summary(ar, child_ics, child_node);
+	update_node_file_extension(ar, child_ics, child_node);
 	return 0;
 }
 
@@ -812,21 +917,47 @@ delete_vdir_entry(arena *ar, struct tree_node *node)
 		return -EIO;
 	}
 
+	record_node_change(ar, CHANGE_DELETE, node, NULL);
+	forget_vdir_file(get_entry(node)->filename_vdir);
+	notify_change_hook();
+
 	delete_fuse_node(node);
 	return res;
 }
 
-// Caller needs to ensure the node has no children.
+// The vdir file is already gone. Children of a removed directory
+// lose their parent and are moved to the root.
 int
-delete_from_vdir_path(arena *ar, const char *filepath)
+delete_from_vdir_path(arena *ar, const char *filename_vdir)
 {
-
-	struct tree_node *node = get_node_by_uuid(ar, filepath);
+	struct tree_node *node = get_fuse_node_from_vdir_name(filename_vdir);
 	if (!node) {
 		return -ENOENT;
 	}
 
-	assert(node->child_count > 0);
+	while (node->child_count > 0) {
+		struct tree_node *child = node->children[0];
+		const char *old_path = get_node_path(ar, child);
+		move_fuse_node(fuse_root, child);
+		record_node_change(ar, CHANGE_RENAME, child, old_path);
+	}
+	record_node_change(ar, CHANGE_DELETE, node, NULL);
 	delete_fuse_node(node);
 	return 0;
 }
+
+void
+delete_vdir_collection(arena *ar, const char *collection)
+{
+	// Copied, deleting an entry removes its key
+	size_t count = 0;
+	char **keys = hashmap_get_keys(entries_vdir, &count);
+	for (size_t i = 0; i < count; i++) {
+		if (is_in_collection(keys[i], collection)) {
+			forget_vdir_file(keys[i]);
+			delete_from_vdir_path(ar, keys[i]);
+		}
+	}
+	hashmap_free_keys(keys, count);
+	remove_vdir_collection(collection);
+}
@@ -27,6 +27,7 @@
 struct tree_node *
 get_node_by_uuid(arena *ar, const char *target_uuid);
 
+// Does not allocate, ar may be NULL
 struct tree_node *
 get_node_by_path(arena *ar, const char *path);
 
@@ -55,16 +56,14 @@ update_summary(arena *ar, icalcomponent *ics,
 	       const struct tree_node *node);
 
 struct agenda_entry *
-parse_ics_to_agenda_entry(arena *ar, const char *vdir_filepath);
+agenda_entry_from_header(arena *ar, const struct ics_header *header,
+			 const char *filename_vdir);
 
 // agenda_entry is automatically cleaned up by ar, use copy_agenda_entry
 // to take ownership!
 struct agenda_entry *
 load_agenda_entry_from_ics_file(arena *ar, const char *filename);
 
-void
-load_root_node_tree();
-
 // Returns comma separated list of categories for a file
 char *
 get_node_categories(arena *ar, const struct tree_node *node);
@@ -93,9 +92,14 @@ int
 set_node_status(arena *ar, const struct tree_node *node,
 		const icalproperty_status new_status);
 
+// Size of the description of node, or of all the descriptions below a
+// directory, from what is cached in the entries
+size_t
+calculate_node_size(const struct tree_node *node);
+
+// Only stats the vdir file, the rest comes from the entry
 struct stat
-get_node_stat(arena *ar, const struct tree_node *node,
-	      icalcomponent *node_component);
+get_node_stat(arena *ar, const struct tree_node *node);
 
 int
 insert_fuse_node_to_path(arena *ar, const char *fuse_path,
@@ -120,9 +124,51 @@ clear_dtstart(arena *ar, struct tree_node *node);
 int
 create_directory_from_fuse_path(arena *ar, const char *fuse_path);
 
-void
+// A vdir file parsed without touching the tree, so it can be prepared
+// without holding any lock. Owned by ar.
+struct parsed_entry {
+	struct agenda_entry *entry;
+	struct ics_header header;
+	// The version of the file that was parsed
+	struct vdir_fingerprint fp;
+};
+
+// Reads a vdir file, unless it is known not to be a journal entry or
+// was last written by agendafs. Returns NULL to skip the file.
+char *
+read_vdir_entry(arena *ar, const char *filename_vdir,
+		struct vdir_fingerprint *fp);
+
+// Returns NULL if header is not a valid entry
+struct parsed_entry *
+parsed_entry_from_header(arena *ar, const char *filename_vdir,
+			 const struct ics_header *header,
+			 const struct vdir_fingerprint *fp);
+
+// Same as read_vdir_entry, for a file that was already stated relative
+// to a dirfd of VDIR
+char *
+read_vdir_entry_at(arena *ar, int vdir_fd, const char *filename_vdir,
+		   const struct vdir_fingerprint *fp);
+
+// Parses the buffer of read_vdir_entry, remembering non-journal files
+struct parsed_entry *
+parse_vdir_buffer(arena *ar, const char *filename_vdir, const char *buffer,
+		  const struct vdir_fingerprint *fp);
+
+// Does file I/O and parsing only, safe to call without entries_lock.
+// filename_vdir is relative to VDIR.
+struct parsed_entry *
+parse_vdir_entry(arena *ar, const char *filename_vdir);
+
+// Links a parsed entry into the tree, unless the file changed since it
+// was read. Caller must hold entries_lock for writing.
+int
+publish_vdir_entry(arena *ar, const struct parsed_entry *parsed);
+
+int
 update_or_create_fuse_entry_from_vdir(arena *ar,
-				      const char *filepath_vdir);
+				      const char *filename_vdir);
 
 int
 delete_dir_from_fuse_path(arena *ar, const char *filepath);
@@ -134,6 +180,11 @@ int
 delete_vdir_entry(arena *ar, struct tree_node *node);
 
 int
-delete_from_vdir_path(arena *ar, const char *filepath);
+delete_from_vdir_path(arena *ar, const char *filename_vdir);
+
+// The directory of collection is gone, the entries in it and in the
+// collections below it are removed from the tree.
+void
+delete_vdir_collection(arena *ar, const char *collection);
 
 #endif // fuse_node_h_INCLUDED
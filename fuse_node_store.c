@@ -1,20 +1,45 @@
 #include "agenda_entry.h"
+#include "fuse_node_store.h"
+#include "body_cache.h"
 #include "hashmap.h"
+#include "intern.h"
 #include "path.h"
 #include "tree.h"
 #include "util.h"
 #include <stddef.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 char VDIR[256];
 
 char FILE_EXTENSION[256] = "";
 
 // A structure of the current root
 struct tree_node *fuse_root = NULL;
-// ics entries, keys are the filename as stored in ICS_DIR
-// I.E. bcb4c14b-8f3f-4a53-ad33-1f4499071a9m-caldavfs.ics
+// ics entries, keys are the filename relative to VDIR
+// I.E. journal/bcb4c14b-8f3f-4a53-ad33-1f4499071a9m-caldavfs.ics
+// Both maps borrow the interned strings of the entries as keys.
 struct hashmap *entries_vdir = NULL;
+struct hashmap *entries_uid = NULL;
+
+// Relative to VDIR, "" is VDIR itself
+static char **collections = NULL;
+static size_t collection_count = 0;
+static char *default_collection = NULL;
+
+// Maps filename_vdir to a vdir_fingerprint, with its own lock
+struct fingerprint_map {
+	struct hashmap *map;
+	pthread_mutex_t lock;
+};
+
+// Non-journal files
+static struct fingerprint_map rejected_vdir = {NULL,
+					       PTHREAD_MUTEX_INITIALIZER};
+// Files as agendafs last wrote them
+static struct fingerprint_map written_vdir = {NULL,
+					      PTHREAD_MUTEX_INITIALIZER};
 
 // Copies vdir
 void
@@ -23,6 +48,91 @@ set_vdir(const char *expanded_path)
 	strlcpy(VDIR, expanded_path, sizeof(VDIR));
 }
 
+void
+add_vdir_collection(const char *collection)
+{
+	for (size_t i = 0; i < collection_count; i++) {
+		if (strcmp(collections[i], collection) == 0) {
+			return;
+		}
+	}
+
+	collections = xreallocarray(collections, collection_count + 1,
+				    sizeof(char *));
+	collections[collection_count++] = xstrdup(collection);
+}
+
+bool
+is_in_collection(const char *path, const char *collection)
+{
+	size_t len = strlen(collection);
+	return strncmp(path, collection, len) == 0 &&
+	       (path[len] == '\0' || path[len] == '/');
+}
+
+void
+remove_vdir_collection(const char *collection)
+{
+	// New entries go to VDIR itself instead
+	if (default_collection &&
+	    is_in_collection(default_collection, collection)) {
+		free(default_collection);
+		default_collection = NULL;
+	}
+
+	for (size_t i = 0; i < collection_count;) {
+		if (is_in_collection(collections[i], collection)) {
+			free(collections[i]);
+			collections[i] = collections[--collection_count];
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+size_t
+vdir_collection_count()
+{
+	return collection_count;
+}
+
+const char *
+get_vdir_collection(size_t i)
+{
+	return collections[i];
+}
+
+const char *
+get_default_collection()
+{
+	return default_collection ? default_collection : "";
+}
+
+void
+set_default_collection(const char *collection)
+{
+	free(default_collection);
+	default_collection = xstrdup(collection);
+}
+
+char *
+vdir_child_path(arena *ar, const char *collection, const char *name)
+{
+	if (*collection == '\0') {
+		return rstrdup(ar, name);
+	}
+	return append_path(ar, collection, name);
+}
+
+char *
+get_node_collection(arena *ar, const struct tree_node *node)
+{
+	const struct agenda_entry *entry = get_entry(node);
+	char *collection = get_parent_path(ar, entry->filename_vdir);
+	return collection ? collection : "";
+}
+
 const char *
 get_default_file_extension()
 {
@@ -44,12 +154,126 @@ set_file_extension(const char *extension)
 	return 0;
 }
 
+// Names of the children of a directory, so a free name is found without
+// comparing it to every sibling. Kept up to date once a directory has one.
+struct child_names {
+	// Filename to the child, the keys are the filenames of the entries
+	struct hashmap *taken;
+	// Filename to the lowest number that may be free when it is taken,
+	// every number below it is taken
+	struct hashmap *next_number;
+};
+
+// filename_vdir of a directory to its struct child_names, "" for the root
+static struct hashmap *directory_names = NULL;
+
+static const char *
+directory_key(const struct tree_node *dir)
+{
+	return is_root_node(dir) ? "" : get_entry(dir)->filename_vdir;
+}
+
+static void
+free_child_names(struct child_names *names)
+{
+	hashmap_free(names->taken);
+	hashmap_free(names->next_number);
+	free(names);
+}
+
+static struct child_names *
+find_child_names(const struct tree_node *dir)
+{
+	if (!dir || !directory_names) {
+		return NULL;
+	}
+	return hashmap_get(directory_names, directory_key(dir));
+}
+
+static void
+drop_child_names(const struct tree_node *dir)
+{
+	if (directory_names) {
+		hashmap_remove(directory_names, directory_key(dir));
+	}
+}
+
+// When two children share a name, it is taken by the first one
+static void
+take_name(struct child_names *names, struct tree_node *child)
+{
+	const char *filename = get_node_filename(child);
+	if (!hashmap_get(names->taken, filename)) {
+		hashmap_insert(names->taken, filename, child);
+	}
+}
+
+// A number that is free again is used first, so a child that is moved
+// back keeps its name
+static void
+release_name(struct child_names *names, struct tree_node *child)
+{
+	const char *filename = get_node_filename(child);
+	if (hashmap_get(names->taken, filename) != child) {
+		return;
+	}
+	hashmap_remove(names->taken, filename);
+
+	size_t n;
+	char *base = filename_unnumbered(filename, &n);
+	if (base) {
+		uintptr_t next =
+		    (uintptr_t)hashmap_get(names->next_number, base);
+		if (next > n) {
+			hashmap_insert(names->next_number, base,
+				       (void *)(uintptr_t)n);
+		}
+		free(base);
+	}
+}
+
+// Replaces the names of dir with empty ones
+static struct child_names *
+reset_child_names(const struct tree_node *dir)
+{
+	if (!directory_names) {
+		directory_names = hashmap_new_borrowing(
+		    hashmap_item_free_func(free_child_names));
+	}
+
+	struct child_names *names = xmalloc(sizeof(struct child_names));
+	names->taken = hashmap_new_borrowing(NULL);
+	names->next_number = hashmap_new(NULL);
+	hashmap_reserve(names->taken, dir->child_count);
+	hashmap_insert(directory_names, directory_key(dir), names);
+	return names;
+}
+
+static struct child_names *
+get_child_names(struct tree_node *dir)
+{
+	struct child_names *names = find_child_names(dir);
+	if (!names) {
+		names = reset_child_names(dir);
+		for (uint32_t i = 0; i < dir->child_count; i++) {
+			take_name(names, dir->children[i]);
+		}
+	}
+	return names;
+}
+
 int
 set_node_filename(struct tree_node *node, const char *filename)
 {
-	struct agenda_entry *entry = node->data;
-	free(entry->filename);
-	entry->filename = xstrdup(filename);
+	// Released first, its key is the filename that is replaced
+	struct child_names *names = find_child_names(node->parent);
+	if (names) {
+		release_name(names, node);
+	}
+	set_agenda_entry_filename(node->data, filename);
+	if (names) {
+		take_name(names, node);
+	}
 	return 0;
 }
 
@@ -88,12 +312,141 @@ get_vdir_filepath(arena *ar, const struct tree_node *node)
 	return append_path(ar, VDIR, entry->filename_vdir);
 }
 
+char *
+get_node_path(arena *ar, const struct tree_node *node)
+{
+	if (is_root_node(node)) {
+		return rstrdup(ar, "/");
+	}
+
+	char *path = rstrdup(ar, "");
+	for (; node && !is_root_node(node); node = node->parent) {
+		rasprintf(ar, &path, "/%s%s", get_node_filename(node), path);
+	}
+	return path;
+}
+
+// The other nodes with the UID of a node in entries_uid, so one of them
+// takes over when it is removed. Only UIDs that are shared have one.
+struct uid_duplicates {
+	struct tree_node **nodes;
+	size_t count;
+	size_t capacity;
+};
+
+// UID to struct uid_duplicates, the keys are the interned UIDs
+static struct hashmap *uid_duplicates = NULL;
+
+static void
+free_uid_duplicates(struct uid_duplicates *dups)
+{
+	free(dups->nodes);
+	free(dups);
+}
+
+static void
+add_uid_duplicate(const char *uid, struct tree_node *node)
+{
+	if (!uid_duplicates) {
+		uid_duplicates = hashmap_new_borrowing(
+		    hashmap_item_free_func(free_uid_duplicates));
+	}
+
+	struct uid_duplicates *dups = hashmap_get(uid_duplicates, uid);
+	if (!dups) {
+		dups = xcalloc(1, sizeof(struct uid_duplicates));
+		hashmap_insert(uid_duplicates, uid, dups);
+	}
+	if (dups->count == dups->capacity) {
+		dups->capacity = dups->capacity ? dups->capacity * 2 : 2;
+		dups->nodes = xreallocarray(dups->nodes, dups->capacity,
+					    sizeof(struct tree_node *));
+	}
+	dups->nodes[dups->count++] = node;
+}
+
+// Removes node, or any node if it is NULL. Returns the removed node.
+static struct tree_node *
+remove_uid_duplicate(const char *uid, struct tree_node *node)
+{
+	struct uid_duplicates *dups = hashmap_get(uid_duplicates, uid);
+	if (!dups) {
+		return NULL;
+	}
+
+	struct tree_node *removed = NULL;
+	for (size_t i = dups->count; i-- > 0;) {
+		if (!node || dups->nodes[i] == node) {
+			removed = dups->nodes[i];
+			dups->nodes[i] = dups->nodes[--dups->count];
+			break;
+		}
+	}
+	if (dups->count == 0) {
+		hashmap_remove(uid_duplicates, uid);
+	}
+	return removed;
+}
+
+// The first entry with a UID keeps it when several files share one
+static void
+index_node_uid(struct tree_node *node)
+{
+	const struct agenda_entry *e = get_entry(node);
+	struct tree_node *owner = hashmap_get(entries_uid, e->uid);
+	if (!owner) {
+		hashmap_insert(entries_uid, e->uid, node);
+	}
+	else if (owner != node) {
+		add_uid_duplicate(e->uid, node);
+	}
+}
+
+static void
+unindex_node_uid(struct tree_node *node)
+{
+	const struct agenda_entry *e = get_entry(node);
+	if (hashmap_get(entries_uid, e->uid) != node) {
+		remove_uid_duplicate(e->uid, node);
+		return;
+	}
+
+	// Another file with the UID takes over, so the children related
+	// to it keep their parent
+	struct tree_node *next = remove_uid_duplicate(e->uid, NULL);
+	if (next) {
+		hashmap_insert(entries_uid, e->uid, next);
+	}
+	else {
+		hashmap_remove(entries_uid, e->uid);
+	}
+}
+
+struct tree_node *
+get_fuse_node_from_uid(const char *uid)
+{
+	return hashmap_get(entries_uid, uid);
+}
+
+// detach_tree_node, the name of node is free again
+static void
+detach_fuse_node(struct tree_node *node)
+{
+	struct child_names *names = find_child_names(node->parent);
+	if (names) {
+		release_name(names, node);
+	}
+	detach_tree_node(node);
+}
+
 void
 delete_fuse_node(struct tree_node *node)
 {
 	const struct agenda_entry *e = get_entry(node);
+	unindex_node_uid(node);
 	hashmap_remove(entries_vdir, e->filename_vdir);
-	detach_tree_node(node);
+	detach_fuse_node(node);
+	drop_child_names(node);
 	free_tree(node);
 }
 
@@ -107,6 +460,7 @@ create_fuse_node(const struct agenda_entry *entry)
 	    create_tree_node(cpy, (void *)free_agenda_entry);
 
 	hashmap_insert(entries_vdir, cpy->filename_vdir, new_node);
+	index_node_uid(new_node);
 
 	return new_node;
 }
@@ -117,7 +471,16 @@ upsert_fuse_node(const struct agenda_entry *entry)
 	struct tree_node *node =
 	    hashmap_get(entries_vdir, entry->filename_vdir);
 	if (node) {
+		struct agenda_entry *existing = node->data;
 		set_node_filename(node, entry->filename);
+		existing->description_size = entry->description_size;
+		existing->is_directory = entry->is_directory;
+		if (strcmp(existing->uid, entry->uid) != 0) {
+			unindex_node_uid(node);
+			release_interned(existing->uid);
+			existing->uid = intern(entry->uid);
+			index_node_uid(node);
+		}
 	}
 	else {
 		node = create_fuse_node(entry);
@@ -131,40 +494,187 @@ upsert_fuse_node(const struct agenda_entry *entry)
 size_t
 add_fuse_child(struct tree_node *parent, struct tree_node *child)
 {
+	struct child_names *names = get_child_names(parent);
 	const char *filename = get_node_filename(child);
 
-	char *new_filename = xstrdup(filename);
+	if (hashmap_get(names->taken, filename)) {
+		uintptr_t n = (uintptr_t)hashmap_get(names->next_number,
+						     filename);
+		if (!n) {
+			n = 1;
+		}
+		char *new_filename = NULL;
+		do {
+			free(new_filename);
+			new_filename = filename_numbered(filename, n++);
+		} while (hashmap_get(names->taken, new_filename));
 
-	size_t conflict_count = 1;
+		hashmap_insert(names->next_number, filename, (void *)n);
+		set_node_filename(child, new_filename);
+		free(new_filename);
+	}
 
-	while (true) {
-		bool is_unique = true;
-		for (size_t i = 0; i < parent->child_count; i++) {
-			const char *sibling_filename =
-			    get_node_filename(parent->children[i]);
+	size_t res = add_child(parent, child);
+	take_name(names, child);
+	return res;
+}
 
-			if (strcmp(new_filename, sibling_filename) == 0) {
-				is_unique = false;
-				break;
-			}
-		}
+static int
+compare_children_by_name(const void *a, const void *b)
+{
+	const struct agenda_entry *ea = (*(struct tree_node *const *)a)->data;
+	const struct agenda_entry *eb = (*(struct tree_node *const *)b)->data;
+	int cmp = strcmp(ea->filename, eb->filename);
+	return cmp ? cmp : strcmp(ea->filename_vdir, eb->filename_vdir);
+}
 
-		if (is_unique) {
-			break;
-		}
+void
+resolve_duplicate_names(struct tree_node *parent)
+{
+	if (parent->child_count < 2) {
+		// Built again from the children once needed
+		drop_child_names(parent);
+		return;
+	}
 
-		free(new_filename);
-		new_filename = filename_numbered(filename, conflict_count++);
+	// Sorted by vdir file within a name, so the same files are numbered
+	// the same way on every mount regardless of readdir order
+	size_t count = parent->child_count;
+	struct tree_node **sorted =
+	    xreallocarray(NULL, count, sizeof(struct tree_node *));
+	memcpy(sorted, parent->children, count * sizeof(struct tree_node *));
+	qsort(sorted, count, sizeof(struct tree_node *),
+	      compare_children_by_name);
+
+	struct child_names *names = reset_child_names(parent);
+	for (size_t i = 0; i < count; i++) {
+		take_name(names, sorted[i]);
 	}
 
-	set_node_filename(child, new_filename);
+	for (size_t i = 1; i < count; i++) {
+		const char *filename = get_node_filename(sorted[i - 1]);
+		size_t first = i - 1;
+		while (i < count &&
+		       strcmp(get_node_filename(sorted[i]), filename) == 0) {
+			i++;
+		}
+		if (i == first + 1) {
+			continue;
+		}
+
+		uintptr_t conflict_count = 1;
+		for (size_t j = first + 1; j < i; j++) {
+			char *new_filename = NULL;
+			do {
+				free(new_filename);
+				new_filename = filename_numbered(
+				    filename, conflict_count++);
+			} while (hashmap_get(names->taken, new_filename));
+
+			set_node_filename(sorted[j], new_filename);
+			free(new_filename);
+		}
+		hashmap_insert(names->next_number, filename,
+			       (void *)conflict_count);
+	}
 
-	return add_child(parent, child);
+	free(sorted);
 }
 
 size_t
 move_fuse_node(struct tree_node *new_parent, struct tree_node *child)
 {
-	detach_tree_node(child);
+	detach_fuse_node(child);
 	return add_fuse_child(new_parent, child);
 }
+
+struct vdir_fingerprint
+vdir_fingerprint_from_stat(const struct stat *st)
+{
+	struct vdir_fingerprint fp = {
+	    .ino = st->st_ino,
+	    .size = st->st_size,
+	    .mtime = st->st_mtim,
+	};
+	return fp;
+}
+
+bool
+vdir_fingerprint_equal(const struct vdir_fingerprint *a,
+		       const struct vdir_fingerprint *b)
+{
+	return a->ino == b->ino && a->size == b->size &&
+	       a->mtime.tv_sec == b->mtime.tv_sec &&
+	       a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static bool
+fingerprint_map_matches(struct fingerprint_map *fm, const char *filename_vdir,
+			const struct vdir_fingerprint *fp)
+{
+	pthread_mutex_lock(&fm->lock);
+	const struct vdir_fingerprint *known =
+	    hashmap_get(fm->map, filename_vdir);
+	bool matches = known && vdir_fingerprint_equal(known, fp);
+	pthread_mutex_unlock(&fm->lock);
+	return matches;
+}
+
+static void
+fingerprint_map_put(struct fingerprint_map *fm, const char *filename_vdir,
+		    const struct vdir_fingerprint *fp)
+{
+	struct vdir_fingerprint *cpy =
+	    xmalloc(sizeof(struct vdir_fingerprint));
+	*cpy = *fp;
+
+	pthread_mutex_lock(&fm->lock);
+	if (!fm->map) {
+		fm->map = hashmap_new(free);
+	}
+	hashmap_insert(fm->map, filename_vdir, cpy);
+	pthread_mutex_unlock(&fm->lock);
+}
+
+static void
+fingerprint_map_remove(struct fingerprint_map *fm, const char *filename_vdir)
+{
+	pthread_mutex_lock(&fm->lock);
+	hashmap_remove(fm->map, filename_vdir);
+	pthread_mutex_unlock(&fm->lock);
+}
+
+bool
+is_rejected_vdir_file(const char *filename_vdir,
+		      const struct vdir_fingerprint *fp)
+{
+	return fingerprint_map_matches(&rejected_vdir, filename_vdir, fp);
+}
+
+void
+reject_vdir_file(const char *filename_vdir, const struct vdir_fingerprint *fp)
+{
+	fingerprint_map_put(&rejected_vdir, filename_vdir, fp);
+}
+
+bool
+is_own_vdir_write(const char *filename_vdir,
+		  const struct vdir_fingerprint *fp)
+{
+	return fingerprint_map_matches(&written_vdir, filename_vdir, fp);
+}
+
+void
+remember_own_vdir_write(const char *filename_vdir,
+			const struct vdir_fingerprint *fp)
+{
+	fingerprint_map_put(&written_vdir, filename_vdir, fp);
+}
+
+void
+forget_vdir_file(const char *filename_vdir)
+{
+	fingerprint_map_remove(&rejected_vdir, filename_vdir);
+	fingerprint_map_remove(&written_vdir, filename_vdir);
+	body_cache_forget(filename_vdir);
+}
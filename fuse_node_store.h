@@ -6,20 +6,60 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 extern char VDIR[256];
 
 // A structure of the current root
 extern struct tree_node *fuse_root;
-// ics entries, keys are the filename as stored in ICS_DIR
-// I.E. bcb4c14b-8f3f-4a53-ad33-1f4499071a9m-caldavfs.ics
+// ics entries, keys are the filename relative to VDIR
+// I.E. journal/bcb4c14b-8f3f-4a53-ad33-1f4499071a9m-caldavfs.ics
 extern struct hashmap *entries_vdir;
+// The same nodes by the UID property of their entry
+extern struct hashmap *entries_uid;
 
 void
 set_vdir(const char *expanded_path);
 
+// Collections are VDIR itself ("") and every directory below it.
+void
+add_vdir_collection(const char *collection);
+
+// path is collection itself or below it, both relative to VDIR
+bool
+is_in_collection(const char *path, const char *collection);
+
+// Removes collection and the collections below it. If the default
+// collection is one of them, VDIR becomes the default.
+void
+remove_vdir_collection(const char *collection);
+
+size_t
+vdir_collection_count();
+
+const char *
+get_vdir_collection(size_t i);
+
+// Collection for new entries that have no parent to follow
+const char *
+get_default_collection();
+
+void
+set_default_collection(const char *collection);
+
+// name inside collection, relative to VDIR
+char *
+vdir_child_path(arena *ar, const char *collection, const char *name);
+
+// Collection the entry of node is stored in
+char *
+get_node_collection(arena *ar, const struct tree_node *node);
+
 int
 set_node_filename(struct tree_node *node, const char *filename);
 
+struct tree_node *
+get_fuse_node_from_uid(const char *uid);
+
 struct tree_node *
 get_fuse_node_from_vdir_name(const char *vdir_name);
 
@@ -53,6 +93,53 @@ add_fuse_child(struct tree_node *parent, struct tree_node *child);
 size_t
 move_fuse_node(struct tree_node *new_parent, struct tree_node *child);
 
+// Numbers the children of parent that share a name in one pass, for
+// children attached with add_child rather than add_fuse_child. Children
+// have to be attached with add_fuse_child after that.
+void
+resolve_duplicate_names(struct tree_node *parent);
+
+// Identifies a version of a vdir file without reading it
+struct vdir_fingerprint {
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+struct vdir_fingerprint
+vdir_fingerprint_from_stat(const struct stat *st);
+
+bool
+vdir_fingerprint_equal(const struct vdir_fingerprint *a,
+		       const struct vdir_fingerprint *b);
+
+// Files that are not VJOURNAL entries are remembered by fingerprint, so
+// they are only read again once they change. Safe without entries_lock.
+bool
+is_rejected_vdir_file(const char *filename_vdir,
+		      const struct vdir_fingerprint *fp);
+
+void
+reject_vdir_file(const char *filename_vdir, const struct vdir_fingerprint *fp);
+
+// Writes of agendafs itself, so the watcher can ignore the events they
+// cause.
+bool
+is_own_vdir_write(const char *filename_vdir,
+		  const struct vdir_fingerprint *fp);
+
+void
+remember_own_vdir_write(const char *filename_vdir,
+			const struct vdir_fingerprint *fp);
+
+// Drops everything remembered about a removed file
+void
+forget_vdir_file(const char *filename_vdir);
+
+// Path of node inside the mount, I.E. /directory/note.txt
+char *
+get_node_path(arena *ar, const struct tree_node *node);
+
 const char *
 get_default_file_extension();
 
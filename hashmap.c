@@ -1,13 +1,18 @@
-// Taken from https://github.com/prismz/hashmap
+// Based on https://github.com/prismz/hashmap, changed to open addressing
 #include "hashmap.h"
 
 #include "arena.h"
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef HM_DEBUG
 #include <stdarg.h>
@@ -41,49 +46,97 @@ hm_check_mem(void *ptr)
 	return 1;
 }
 
-/* hash a single byte */
-static uint32_t
-fnv1a(unsigned char byte, uint32_t hash)
+/*
+ * Keys are hashed 16 bytes at a time with 64 bit multiplications, after
+ * wyhash. The seed is random per process, so names can not be crafted
+ * to collide.
+ */
+#define HM_SECRET0 0xa0761d6478bd642full
+#define HM_SECRET1 0xe7037ed1a0b428dbull
+#define HM_SECRET2 0x8ebc6af09c88c6e3ull
+
+static uint64_t hash_seed;
+static pthread_once_t hash_seed_once = PTHREAD_ONCE_INIT;
+
+static void
+init_hash_seed(void)
 {
-	return (byte ^ hash) * HM_FNV_PRIME;
+	if (getrandom(&hash_seed, sizeof(hash_seed), GRND_NONBLOCK) !=
+	    sizeof(hash_seed)) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		hash_seed = now.tv_nsec ^ ((uint64_t)now.tv_sec << 32) ^
+			    ((uint64_t)getpid() << 16);
+	}
 }
 
-static uint32_t
-fnv1a_hash(const char *str)
+static uint64_t
+mix(uint64_t a, uint64_t b)
 {
-	uint32_t hash = HM_FNV_SEED;
-	while (*str)
-		hash = fnv1a((unsigned char)*str++, hash);
-	return hash;
+	__uint128_t product = (__uint128_t)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
 }
 
-/* will duplicate key */
-static struct bucket *
-new_bucket(const char *key, void *val)
+static uint64_t
+read64(const unsigned char *p)
 {
-	if (key == NULL)
-		return NULL;
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
 
-	struct bucket *b = HM_CALLOC_FUNC(1, sizeof(struct bucket));
-	if (hm_check_mem(b))
-		return NULL;
+static uint64_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
 
-	b->key = HM_STRDUP_FUNC(key);
-	if (hm_check_mem(b->key)) {
-		free(b);
-		return NULL;
+uint32_t
+hashmap_hash(const char *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	size_t len = strlen(key);
+	uint64_t seed = hash_seed ^ mix(hash_seed ^ HM_SECRET0, HM_SECRET1);
+	uint64_t a = 0, b = 0;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			// Overlapping reads cover every length
+			size_t middle = (len >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + middle);
+			b = (read32(p + len - 4) << 32) |
+			    read32(p + len - 4 - middle);
+		}
+		else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) |
+			    ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+		}
+	}
+	else {
+		size_t i = len;
+		for (; i > 16; i -= 16, p += 16) {
+			seed =
+			    mix(read64(p) ^ HM_SECRET1, read64(p + 8) ^ seed);
+		}
+		a = read64(p + i - 16);
+		b = read64(p + i - 8);
 	}
 
-	b->val = val;
-	b->next = NULL;
-
-	b->hash = fnv1a_hash(key);
-
-	debug_print("creating bucket with key %s, hash of this key is %" PRIu32
-		    "\n",
-		    key, b->hash);
+	uint64_t hash =
+	    mix(HM_SECRET1 ^ len, mix(a ^ HM_SECRET1, b ^ seed) ^ HM_SECRET2);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
 
-	return b;
+static struct bucket *
+new_buckets(size_t capacity)
+{
+	struct bucket *buckets =
+	    HM_CALLOC_FUNC(capacity, sizeof(struct bucket));
+	if (hm_check_mem(buckets))
+		return NULL;
+	return buckets;
 }
 
 struct hashmap *
@@ -92,6 +145,8 @@ hashmap_new(void (*val_free_func)(void *))
 	/* Any smaller and we'd pretty much instantly have to resize */
 	size_t capacity = HM_DEFAULT_HASHMAP_SIZE;
 
+	pthread_once(&hash_seed_once, init_hash_seed);
+
 	struct hashmap *hm = HM_CALLOC_FUNC(1, sizeof(struct hashmap));
 	if (hm_check_mem(hm))
 		return NULL;
@@ -99,8 +154,8 @@ hashmap_new(void (*val_free_func)(void *))
 	hm->capacity = capacity;
 	hm->n_buckets = 0;
 	hm->val_free_func = val_free_func;
-	hm->buckets = HM_CALLOC_FUNC(capacity, sizeof(struct bucket *));
-	if (hm_check_mem(hm->buckets)) {
+	hm->buckets = new_buckets(capacity);
+	if (!hm->buckets) {
 		free(hm);
 		return NULL;
 	}
@@ -108,22 +163,40 @@ hashmap_new(void (*val_free_func)(void *))
 	return hm;
 }
 
+struct hashmap *
+hashmap_new_borrowing(void (*val_free_func)(void *))
+{
+	struct hashmap *hm = hashmap_new(val_free_func);
+	if (hm)
+		hm->borrow_keys = true;
+	return hm;
+}
+
 static void
-free_bucket(struct bucket *b, void (*val_free_func)(void *))
+free_bucket(const struct hashmap *hm, struct bucket *b)
 {
-	if (b == NULL)
-		return;
+	if (!hm->borrow_keys)
+		free(b->key);
+	if (hm->val_free_func != NULL && b->val != NULL)
+		hm->val_free_func(b->val);
+}
 
-	struct bucket *curr;
-	while (b != NULL) {
-		curr = b;
-		b = b->next;
+// Empty slots and tombstones of the old table have no key
+static bool
+has_entry(const struct bucket *b)
+{
+	return b->dist != 0 && b->key != NULL;
+}
 
-		free(curr->key);
-		if (val_free_func != NULL && curr->val != NULL)
-			val_free_func(curr->val);
-		free(curr);
+static void
+free_buckets(const struct hashmap *hm, struct bucket *buckets,
+	     size_t capacity)
+{
+	for (size_t i = 0; i < capacity; i++) {
+		if (has_entry(&buckets[i]))
+			free_bucket(hm, &buckets[i]);
 	}
+	free(buckets);
 }
 
 void
@@ -131,126 +204,179 @@ hashmap_free(struct hashmap *hm)
 {
 	if (hm == NULL)
 		return;
-	for (size_t i = 0; i < hm->capacity; i++) {
-		if (hm->buckets[i] == NULL)
-			continue;
-		free_bucket(hm->buckets[i], hm->val_free_func);
-	}
-	free(hm->buckets);
+	free_buckets(hm, hm->buckets, hm->capacity);
+	if (hm->old_buckets)
+		free_buckets(hm, hm->old_buckets, hm->old_capacity);
 	free(hm);
 }
 
+/*
+ * Robin Hood insertion: an entry that is further from its slot than
+ * the one it meets takes that slot, and the displaced entry moves on.
+ * This keeps the longest probe sequences short.
+ */
+static void
+place_bucket(struct bucket *buckets, size_t capacity, struct bucket b)
+{
+	size_t mask = capacity - 1;
+	size_t idx = b.hash & mask;
+	b.dist = 1;
+
+	while (buckets[idx].dist != 0) {
+		if (buckets[idx].dist < b.dist) {
+			struct bucket displaced = buckets[idx];
+			buckets[idx] = b;
+			b = displaced;
+		}
+		b.dist++;
+		idx = (idx + 1) & mask;
+	}
+	buckets[idx] = b;
+}
+
+// Moves up to count slots of the old table to the new one
+static void
+migrate(struct hashmap *hm, size_t count)
+{
+	if (!hm->old_buckets)
+		return;
+
+	size_t end = hm->migrated + count;
+	if (count > hm->old_capacity || end > hm->old_capacity)
+		end = hm->old_capacity;
+
+	for (size_t i = hm->migrated; i < end; i++) {
+		struct bucket *b = &hm->old_buckets[i];
+		if (has_entry(b)) {
+			place_bucket(hm->buckets, hm->capacity, *b);
+			b->key = NULL;
+		}
+	}
+	hm->migrated = end;
+
+	if (hm->migrated == hm->old_capacity) {
+		debug_print("migrated %zu slots\n", hm->old_capacity);
+		free(hm->old_buckets);
+		hm->old_buckets = NULL;
+		hm->old_capacity = 0;
+		hm->migrated = 0;
+	}
+}
+
 int
 hashmap_resize(struct hashmap *hm)
 {
 	if (hm == NULL)
 		return -1;
 
-	size_t new_size = hm->capacity * HM_RESIZE_SCALE_FACTOR;
+	// Only one table is migrated at a time
+	migrate(hm, SIZE_MAX);
 
-	struct bucket **buckets =
-	    HM_CALLOC_FUNC(new_size, sizeof(struct bucket *));
-	if (hm_check_mem(buckets))
+	size_t new_size = hm->capacity * HM_RESIZE_SCALE_FACTOR;
+	struct bucket *buckets = new_buckets(new_size);
+	if (!buckets)
 		return 1;
 
-	for (size_t i = 0; i < hm->capacity; i++) {
-		if (hm->buckets[i] == NULL)
-			continue;
-
-		struct bucket *target = hm->buckets[i];
-		struct bucket *curr;
-		while (target != NULL) {
-			curr = target;
-			target = target->next;
-
-			size_t curr_new_idx = curr->hash % (uint32_t)(new_size);
-
-			if (buckets[curr_new_idx] == NULL) {
-				buckets[curr_new_idx] = curr;
-				buckets[curr_new_idx]->next = NULL;
-				continue;
-			}
-
-			/* collision */
+	debug_print("resizing from %zu to %zu slots\n", hm->capacity,
+		    new_size);
+	hm->old_buckets = hm->buckets;
+	hm->old_capacity = hm->capacity;
+	hm->migrated = 0;
+	hm->buckets = buckets;
+	hm->capacity = new_size;
+	return 0;
+}
 
-			struct bucket *ptr = buckets[curr_new_idx];
-			while (ptr->next != NULL)
-				ptr = ptr->next;
+int
+hashmap_reserve(struct hashmap *hm, size_t count)
+{
+	if (hm == NULL)
+		return -1;
 
-			ptr->next = curr;
-			ptr->next->next = NULL;
-		}
+	migrate(hm, SIZE_MAX);
+	size_t new_size = hm->capacity;
+	while ((float)count > HM_HASHMAP_MAX_LOAD * (float)new_size)
+		new_size *= HM_RESIZE_SCALE_FACTOR;
+	if (new_size == hm->capacity)
+		return 0;
 
-		/* size_t new_idx = hm->buckets[i]->hash % (uint32_t)new_size;
-		debug_print("buckets at idx %ld move to idx %ld\n", i, new_idx);
-		if (buckets[new_idx] != NULL) {
-			free(buckets);
-			return 1;
-		}
-		buckets[new_idx] = hm->buckets[i]; */
+	struct bucket *buckets = new_buckets(new_size);
+	if (!buckets)
+		return 1;
+	for (size_t i = 0; i < hm->capacity; i++) {
+		if (has_entry(&hm->buckets[i]))
+			place_bucket(buckets, new_size, hm->buckets[i]);
 	}
-
 	free(hm->buckets);
 	hm->buckets = buckets;
 	hm->capacity = new_size;
-
 	return 0;
 }
 
+// Stops at the first slot that is closer to its home than the key
+// would be, as the key would have displaced it
+static struct bucket *
+find_in(struct bucket *buckets, size_t capacity, const char *key,
+	uint32_t hash)
+{
+	size_t mask = capacity - 1;
+	size_t idx = hash & mask;
+
+	for (uint32_t dist = 1; buckets[idx].dist >= dist; dist++) {
+		struct bucket *b = &buckets[idx];
+		// Interned keys match by address
+		if (b->hash == hash && b->key &&
+		    (b->key == key || strcmp(b->key, key) == 0))
+			return b;
+		idx = (idx + 1) & mask;
+	}
+	return NULL;
+}
+
+static struct bucket *
+find_bucket(struct hashmap *hm, const char *key, uint32_t hash)
+{
+	struct bucket *b = find_in(hm->buckets, hm->capacity, key, hash);
+	if (!b && hm->old_buckets)
+		b = find_in(hm->old_buckets, hm->old_capacity, key, hash);
+	return b;
+}
+
 int
 hashmap_insert(struct hashmap *hm, const char *key, void *val)
 {
 	if (hm == NULL || key == NULL)
 		return 1;
 
+	uint32_t hash = hashmap_hash(key);
+	migrate(hm, HM_MIGRATE_STEP);
+
+	/* changing value of something already in the hashmap */
+	struct bucket *existing = find_bucket(hm, key, hash);
+	if (existing) {
+		debug_print("key already exists, reassigning value\n");
+
+		/* we free the old value, should probably add an
+		 * option for this */
+		if (hm->val_free_func != NULL)
+			hm->val_free_func(existing->val);
+		existing->val = val;
+		return 0;
+	}
+
 	if ((float)(hm->n_buckets + 1) >
 	    (HM_HASHMAP_MAX_LOAD * (float)hm->capacity)) {
 		if (hashmap_resize(hm))
 			return -1;
 	}
 
-	hm->n_buckets++;
-	struct bucket *b = new_bucket(key, val);
-	if (hm_check_mem(b))
+	struct bucket b = {.hash = hash, .val = val};
+	b.key = hm->borrow_keys ? (char *)key : HM_STRDUP_FUNC(key);
+	if (hm_check_mem(b.key))
 		return 1;
-	size_t idx = (b->hash) % (uint32_t)(hm->capacity);
-
-	struct bucket *target_bucket = hm->buckets[idx];
-	if (target_bucket == NULL) {
-		debug_print("insert: bucket with key %s goes to idx %ld\n",
-			    b->key, idx);
-		hm->buckets[idx] = b;
-		return 0;
-	}
-
-	/* changing value of something already in the hashmap */
-	struct bucket *curr;
-	while (target_bucket != NULL) {
-		curr = target_bucket;
-		target_bucket = target_bucket->next;
-		if (curr->hash == b->hash && strcmp(curr->key, key) == 0) {
-			debug_print("key already exists, reassigning value\n");
-
-			/* we free the old value, should probably add an
-			 * option for this */
-			if (hm->val_free_func != NULL)
-				hm->val_free_func(curr->val);
-			curr->val = val;
-			free_bucket(b, NULL);
-			return 0;
-		}
-	}
-
-	debug_print("collision. appending to linked list\n");
-
-	target_bucket = hm->buckets[idx];
-
-	while (target_bucket->next != NULL)
-		target_bucket = target_bucket->next;
-
-	target_bucket->next = b;
-	b->next = NULL;
 
+	place_bucket(hm->buckets, hm->capacity, b);
+	hm->n_buckets++;
 	return 0;
 }
 
@@ -260,79 +386,8 @@ hashmap_get(struct hashmap *hm, const char *key)
 	if (hm == NULL || key == NULL)
 		return NULL;
 
-	uint32_t hash = fnv1a_hash(key);
-	size_t idx = hash % (uint32_t)(hm->capacity);
-	debug_print("retreiving object with key %s - hashes to %" PRIu32
-		    " giving idx %ld\n",
-		    key, hash, idx);
-
-	struct bucket *target_bucket = hm->buckets[idx];
-	if (target_bucket == NULL)
-		return NULL;
-
-	if (target_bucket->hash == hash && strcmp(target_bucket->key, key) == 0)
-		return target_bucket->val;
-
-	/* collision */
-	struct bucket *curr;
-	while (target_bucket != NULL) {
-		curr = target_bucket;
-		target_bucket = target_bucket->next;
-		if (curr->hash == hash && strcmp(curr->key, key) == 0)
-			return curr->val;
-	}
-
-#ifdef HM_DONTTRUSTHASH
-	/* search all items as a last resort */
-	for (size_t i = 0; i < hm->capacity; i++) {
-		struct bucket *b = hm->buckets[i];
-		struct bucket *curr;
-		while (b != NULL) {
-			curr = b;
-			b = b->next;
-
-			if (curr->hash == hash && strcmp(curr->key, key) == 0)
-				return curr->val;
-		}
-	}
-#endif
-
-	return NULL;
-}
-
-/*
- * wrapper function, so that if we don't find it with normal
- * methods, we can easily re-call the function with a custom index, allowing
- * us to iterate through the hashmap to find the item if for some
- * reason the hash gives an incorrect index
- */
-static int
-_hashmap_remove(struct hashmap *hm, const char *key, uint32_t hash, size_t idx)
-{
-	if (hm == NULL || key == NULL)
-		return 1;
-
-	struct bucket *target = hm->buckets[idx];
-	struct bucket *prev = NULL;
-
-	while (target != NULL) {
-		if (target->hash == hash && strcmp(target->key, key) == 0) {
-			if (prev == NULL) {
-				// Removing first node in bucket chain
-				hm->buckets[idx] = target->next;
-			}
-			else {
-				prev->next = target->next;
-			}
-			target->next = NULL;
-			free_bucket(target, hm->val_free_func);
-			hm->n_buckets--;
-			return 0;
-		}
-		prev = target;
-		target = target->next;
-	}
-	return 1;
+	struct bucket *b = find_bucket(hm, key, hashmap_hash(key));
+	return b ? b->val : NULL;
 }
 
 int
@@ -341,33 +396,34 @@ hashmap_remove(struct hashmap *hm, const char *key)
 	if (hm == NULL || key == NULL)
 		return 1;
 
-	uint32_t hash = fnv1a_hash(key);
-	size_t idx = hash % (uint32_t)(hm->capacity);
-
-	if (_hashmap_remove(hm, key, hash, idx) == 0)
-		return 0;
+	migrate(hm, HM_MIGRATE_STEP);
+	struct bucket *b = find_bucket(hm, key, hashmap_hash(key));
+	if (!b)
+		return 1;
 
-#ifdef HM_DONTTRUSTHASH
-	debug_print("couldn't find item to remove by hashing, must search "
-		    "entire hashmap\n");
-	for (size_t i = 0; i < hm->capacity; i++) {
-		/* skip if we already processed the index or if the item is NULL
-		 */
-		if (hm->buckets[i] == NULL || i == idx)
-			continue;
+	free_bucket(hm, b);
+	hm->n_buckets--;
 
-		if (_hashmap_remove(hm, key, hash, i) == 0) {
-			debug_print(
-			    "successfully found and removed item at idx %ld\n",
-			    i);
-			return 0;
-		}
+	// Entries of the old table are not moved, it goes away as a whole
+	if (hm->old_buckets && b >= hm->old_buckets &&
+	    b < hm->old_buckets + hm->old_capacity) {
+		b->key = NULL;
+		return 0;
 	}
 
-	debug_print("couldn't find item to remove anywhere, returning 1\n");
-#endif
-
-	return 1;
+	// Shifts the following entries back until one is in its own slot,
+	// so lookups never stop early at the hole
+	size_t mask = hm->capacity - 1;
+	size_t idx = b - hm->buckets;
+	size_t next = (idx + 1) & mask;
+	while (hm->buckets[next].dist > 1) {
+		hm->buckets[idx] = hm->buckets[next];
+		hm->buckets[idx].dist--;
+		idx = next;
+		next = (next + 1) & mask;
+	}
+	memset(&hm->buckets[idx], 0, sizeof(struct bucket));
+	return 0;
 }
 
 /* only works for hashmap with strings as values */
@@ -383,21 +439,18 @@ hashmap_print(struct hashmap *hm)
 	       hm->n_buckets, hm->capacity);
 
 	for (size_t i = 0; i < hm->capacity; i++) {
-		struct bucket *target = hm->buckets[i];
+		struct bucket *b = &hm->buckets[i];
 		printf("bucket %02ld:\n", i);
-		if (target == NULL)
+		if (!has_entry(b))
 			continue;
-
-		struct bucket *curr;
-		int n = 0;
-		while (target != NULL) {
-			curr = target;
-			target = target->next;
-			printf("    %02d: %s=%s\n", n, curr->key,
-			       (char *)curr->val);
-
-			n++;
-		}
+		printf("    %s=%s (probe %" PRIu32 ")\n", b->key,
+		       (char *)b->val, b->dist);
+	}
+	for (size_t i = hm->migrated; i < hm->old_capacity; i++) {
+		struct bucket *b = &hm->old_buckets[i];
+		if (has_entry(b))
+			printf("    old %02ld: %s=%s\n", i, b->key,
+			       (char *)b->val);
 	}
 }
 
@@ -413,11 +466,12 @@ hashmap_get_keys(struct hashmap *hm, size_t *n_keys)
 
 	size_t count = 0;
 	for (size_t i = 0; i < hm->capacity; i++) {
-		struct bucket *b = hm->buckets[i];
-		while (b) {
-			keys[count++] = strdup(b->key);
-			b = b->next;
-		}
+		if (has_entry(&hm->buckets[i]))
+			keys[count++] = strdup(hm->buckets[i].key);
+	}
+	for (size_t i = 0; i < hm->old_capacity; i++) {
+		if (has_entry(&hm->old_buckets[i]))
+			keys[count++] = strdup(hm->old_buckets[i].key);
 	}
 
 	*n_keys = count;
@@ -1,9 +1,10 @@
-// Taken from https://github.com/prismz/hashmap
+// Based on https://github.com/prismz/hashmap, changed to open addressing
 //
 #ifndef HASHMAP_H
 #define HASHMAP_H
 
 #include "arena.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,19 +13,18 @@
 #define HM_CALLOC_FUNC calloc
 #define HM_STRDUP_FUNC strdup
 #define HM_EXIT_ON_ALLOC_FAIL 1
-#define HM_HASHMAP_MAX_LOAD 0.70f
+// Robin Hood hashing keeps probes short up to high loads
+#define HM_HASHMAP_MAX_LOAD 0.85f
 #define HM_RESIZE_SCALE_FACTOR 2
+// Must be a power of two
 #define HM_DEFAULT_HASHMAP_SIZE 16
+// Slots of the old table moved by each insert or remove while resizing
+#define HM_MIGRATE_STEP 64
 
 /* enabling this will print something for
  * each internal action, not recommended */
 // #define HM_DEBUG
 
-/* if enabled this will not trust the hash function.
- * It will search every item in the hashmap (after trying
- * the hashing method). */
-// #define HM_DONTTRUSTHASH
-
 /*
  * if using structs as values, this conveniently
  * typecasts your struct's free function
@@ -32,35 +32,63 @@
  */
 #define hashmap_item_free_func(a) (void (*)(void *)) a
 
-/* https://create.stephan-brumme.com/fnv-hash */
-#define HM_FNV_PRIME 0x01000193 //   16777619
-#define HM_FNV_SEED 0x811C9DC5	// 2166136261
 typedef void (*hashmap_iter_callback)(const char *key, void *value,
 				      void *user_data);
 
-struct bucket;
+/*
+ * One slot of the table. Entries are stored in the slots themselves,
+ * starting at their hash and moving on to the next free slot. The hash
+ * is kept so most mismatches are found without comparing keys.
+ */
 struct bucket {
 	uint32_t hash;
+	// Distance from the slot of the hash plus one, 0 if empty
+	uint32_t dist;
 	char *key;
 	void *val;
-
-	/* collisions are stored as linked lists */
-	struct bucket *next;
 };
 
+/*
+ * Resizing moves the entries to the new table a few slots at a time,
+ * so no single insert pays for rehashing everything. Until it is done
+ * both tables are searched. Entries that were moved or removed stay in
+ * the old table as tombstones without a key, so lookups keep probing
+ * past them.
+ */
 struct hashmap {
-	struct bucket **buckets;
+	struct bucket *buckets;
+	// Number of entries, in both tables
 	size_t n_buckets;
+	// Number of slots, a power of two
 	size_t capacity;
 	void (*val_free_func)(void *);
+	// Keys are not copied, see hashmap_new_borrowing
+	bool borrow_keys;
+
+	// The table being migrated, NULL if not resizing
+	struct bucket *old_buckets;
+	size_t old_capacity;
+	// Slots of the old table below this are migrated
+	size_t migrated;
 };
 
 struct hashmap *
 hashmap_new(void (*val_free_func)(void *));
+// Keys are stored as given instead of copied, so they have to outlive
+// their entry, I.E. interned strings
+struct hashmap *
+hashmap_new_borrowing(void (*val_free_func)(void *));
+// The hash of a key, seeded once per process by the first hashmap_new
+uint32_t
+hashmap_hash(const char *key);
 void
 hashmap_free(struct hashmap *hm);
+// Starts moving the entries to a table twice the size
 int
 hashmap_resize(struct hashmap *hm);
+// Makes room for count entries at once, so inserting them does not resize
+int
+hashmap_reserve(struct hashmap *hm, size_t count);
 int
 hashmap_insert(struct hashmap *hm, const char *key, void *val);
 void *
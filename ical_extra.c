@@ -1,3 +1,5 @@
+// memmem
+#define _GNU_SOURCE
 #include "ical_extra.h"
 #include "libical/ical.h"
 #include "arena.h"
@@ -5,7 +7,14 @@
 #include "sys/stat.h"
 #include "util.h"
 #include "uuid/uuid.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
 const char *IS_DIRECTORY_PROPERTY = "X-CALDAVFS-ISDIRECTORY";
 const char *FILE_EXTENSION_PROPERTY = "X-CALDAVFS-FILEEXT";
 const char *CUSTOM_PROPERTY_PREFIX = "X-CALDAVFS-CUSTOM-";
@@ -127,23 +136,297 @@ is_directory_component(icalcomponent *component)
 	return is_directory && strcmp(is_directory, "YES") == 0;
 }
 
+char *
+read_ics_file_at(arena *ar, int dirfd, const char *filename, size_t size)
+{
+	int fd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		LOG("Can not open %s", filename);
+		return NULL;
+	}
+	// Lets the kernel read the whole file ahead on slow disks
+	posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+	char *buffer = rmalloc(ar, size + 1);
+
+	size_t bytes_read = 0;
+	while (bytes_read < size) {
+		ssize_t n = read(fd, buffer + bytes_read, size - bytes_read);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		bytes_read += n;
+	}
+	buffer[bytes_read] = '\0';
+	close(fd);
+
+	return buffer;
+}
+
+char *
+read_ics_file(arena *ar, const char *filename, size_t size)
+{
+	return read_ics_file_at(ar, AT_FDCWD, filename, size);
+}
+
+// Component and property names are case-insensitive, so every line start
+// is compared without case. Files that only look like journals here are
+// still rejected by libical afterwards.
+bool
+ics_has_vjournal(const char *buffer, size_t len)
+{
+	static const char needle[] = "BEGIN:VJOURNAL";
+	const size_t needle_len = sizeof(needle) - 1;
+	const char *end = buffer + len;
+	const char *line = buffer;
+	while ((size_t)(end - line) >= needle_len) {
+		if (strncasecmp(line, needle, needle_len) == 0) {
+			return true;
+		}
+		line = memchr(line, '\n', end - line);
+		if (!line) {
+			break;
+		}
+		line++;
+	}
+	return false;
+}
+
+// Iterates over the characters of a content line, skipping the line
+// breaks it was folded at
+struct unfolded_line {
+	const char *pos;
+	const char *end;
+};
+
+static int
+unfolded_next(struct unfolded_line *line)
+{
+	if (line->pos < line->end && *line->pos == '\r' &&
+	    line->end - line->pos > 1 && line->pos[1] == '\n') {
+		line->pos++;
+	}
+	if (line->pos < line->end && *line->pos == '\n') {
+		// Only folds are left inside a line
+		line->pos += 2;
+	}
+	if (line->pos >= line->end) {
+		return EOF;
+	}
+	return (unsigned char)*line->pos++;
+}
+
+// Finds the end of the content line starting at pos, following folds
+static const char *
+content_line_end(const char *pos, const char *end)
+{
+	while (pos < end) {
+		const char *nl = memchr(pos, '\n', end - pos);
+		if (!nl) {
+			return end;
+		}
+		if (nl + 1 < end && (nl[1] == ' ' || nl[1] == '\t')) {
+			pos = nl + 1;
+			continue;
+		}
+		return nl > pos && nl[-1] == '\r' ? nl - 1 : nl;
+	}
+	return end;
+}
+
+// Reads the property name, upper cased, and leaves line at the
+// parameters or the value. Returns the separator, or EOF.
+static int
+read_property_name(struct unfolded_line *line, char *name, size_t size)
+{
+	size_t len = 0;
+	int c;
+	while ((c = unfolded_next(line)) != EOF && c != ';' && c != ':') {
+		if (len + 1 < size) {
+			name[len++] = toupper(c);
+		}
+	}
+	name[len] = '\0';
+	return c;
+}
+
+// Reads the parameters up to the value, unquoted and null terminated,
+// as "KEY=VALUE;KEY=VALUE"
+static char *
+read_property_params(arena *ar, struct unfolded_line *line)
+{
+	char *params = rmalloc(ar, line->end - line->pos + 1);
+	size_t len = 0;
+	bool quoted = false;
+	int c;
+	while ((c = unfolded_next(line)) != EOF) {
+		if (c == '"') {
+			quoted = !quoted;
+			continue;
+		}
+		if (c == ':' && !quoted) {
+			break;
+		}
+		params[len++] = c;
+	}
+	params[len] = '\0';
+	return params;
+}
+
+// Reads the value, unescaping TEXT values like libical does
+static char *
+read_property_value(arena *ar, struct unfolded_line *line, bool text)
+{
+	char *value = rmalloc(ar, line->end - line->pos + 1);
+	size_t len = 0;
+	int c;
+	while ((c = unfolded_next(line)) != EOF) {
+		if (text && c == '\\') {
+			c = unfolded_next(line);
+			if (c == EOF) {
+				break;
+			}
+			if (c == 'n' || c == 'N') {
+				c = '\n';
+			}
+		}
+		value[len++] = c;
+	}
+	value[len] = '\0';
+	return value;
+}
+
+static size_t
+text_value_size(struct unfolded_line *line)
+{
+	size_t size = 0;
+	int c;
+	while ((c = unfolded_next(line)) != EOF) {
+		if (c == '\\' && unfolded_next(line) == EOF) {
+			break;
+		}
+		size++;
+	}
+	return size;
+}
+
+static bool
+has_reltype(const char *params, const char *reltype)
+{
+	for (const char *param = params; param && *param;) {
+		const char *next = strchr(param, ';');
+		size_t len = next ? (size_t)(next - param) : strlen(param);
+		if (len > 8 && strncasecmp(param, "RELTYPE=", 8) == 0 &&
+		    len - 8 == strlen(reltype) &&
+		    strncasecmp(param + 8, reltype, len - 8) == 0) {
+			return true;
+		}
+		param = next ? next + 1 : NULL;
+	}
+	return false;
+}
+
+enum ics_scan
+scan_ics_header(arena *ar, const char *buffer, size_t len,
+		struct ics_header *header)
+{
+	memset(header, 0, sizeof(struct ics_header));
+
+	const char *end = buffer + len;
+	size_t depth = 0;
+	size_t journal_depth = 0;
+	bool has_description = false;
+
+	for (const char *pos = buffer; pos < end;) {
+		const char *line_end = content_line_end(pos, end);
+		struct unfolded_line line = {pos, line_end};
+		pos = line_end;
+		while (pos < end && (*pos == '\r' || *pos == '\n')) {
+			pos++;
+		}
+
+		char name[64];
+		int sep = read_property_name(&line, name, sizeof(name));
+		if (sep == EOF) {
+			continue;
+		}
+		char *params =
+		    sep == ';' ? read_property_params(ar, &line) : NULL;
+
+		if (strcmp(name, "BEGIN") == 0) {
+			char *component = read_property_value(ar, &line, false);
+			depth++;
+			// Only timezones may come before the journal
+			if (journal_depth == 0 && depth == 2 &&
+			    strcasecmp(component, "VTIMEZONE") != 0) {
+				if (strcasecmp(component, "VJOURNAL") != 0) {
+					return ICS_NOT_JOURNAL;
+				}
+				journal_depth = depth;
+			}
+			continue;
+		}
+		if (strcmp(name, "END") == 0) {
+			if (journal_depth && depth == journal_depth) {
+				return ICS_JOURNAL;
+			}
+			depth = depth ? depth - 1 : 0;
+			continue;
+		}
+		// Skips alarms and anything else nested in the journal
+		if (journal_depth == 0 || depth != journal_depth) {
+			continue;
+		}
+
+		if (strcmp(name, "SUMMARY") == 0 && !header->summary) {
+			header->summary = read_property_value(ar, &line, true);
+		}
+		else if (strcmp(name, "UID") == 0 && !header->uid) {
+			header->uid = read_property_value(ar, &line, true);
+		}
+		else if (strcmp(name, "DESCRIPTION") == 0 && !has_description) {
+			header->description_size = text_value_size(&line);
+			has_description = true;
+		}
+		else if (strcmp(name, "RELATED-TO") == 0) {
+			bool is_parent = has_reltype(params, "PARENT");
+			if (is_parent && !header->parent_uid) {
+				header->parent_uid =
+				    read_property_value(ar, &line, true);
+			}
+			else if (!is_parent && has_reltype(params, "CHILD")) {
+				header->is_directory = true;
+			}
+		}
+		else if (strcasecmp(name, IS_DIRECTORY_PROPERTY) == 0) {
+			char *value = read_property_value(ar, &line, false);
+			header->is_directory |= strcmp(value, "YES") == 0;
+		}
+		else if (strcasecmp(name, FILE_EXTENSION_PROPERTY) == 0 &&
+			 !header->file_extension) {
+			char *value = read_property_value(ar, &line, false);
+			header->file_extension =
+			    strcmp(value, ".") == 0 ? "" : value;
+		}
+	}
+
+	return journal_depth ? ICS_TRUNCATED : ICS_NOT_JOURNAL;
+}
+
 icalcomponent *
 parse_ics_file(arena *ar, const char *filename)
 {
-
-	FILE *file = fopen(filename, "r");
 	LOG("filename is %s", filename);
 
 	struct stat st;
 	// Each node corresponds to a file on the system.
 	assert(stat(filename, &st) == 0);
 
-	size_t size = st.st_size;
-	char *buffer = rmalloc(ar, size + 1);
-
-	size_t bytes_read = fread(buffer, 1, size, file);
-	buffer[bytes_read] = '\0';
-	fclose(file);
+	char *buffer = read_ics_file(ar, filename, st.st_size);
+	assert(buffer);
 
 	icalcomponent *component = ricalcomponent_new_from_string(ar, buffer);
 
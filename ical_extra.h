@@ -12,6 +12,46 @@ get_last_modified(icalcomponent *component);
 bool
 is_directory_component(icalcomponent *component);
 
+// Reads size bytes of filename into a null terminated buffer.
+// Owner: ctx
+char *
+read_ics_file(arena *ar, const char *filename, size_t size);
+
+// Same as read_ics_file, with filename relative to dirfd
+char *
+read_ics_file_at(arena *ar, int dirfd, const char *filename, size_t size);
+
+// Cheap check before handing a file to libical
+bool
+ics_has_vjournal(const char *buffer, size_t len);
+
+// What the tree needs of a journal entry, read without libical.
+// Strings are owned by the arena passed to scan_ics_header.
+struct ics_header {
+	const char *summary;
+	const char *uid;
+	const char *parent_uid;
+	// NULL if not set, "" for none
+	const char *file_extension;
+	bool is_directory;
+	// Length of the unescaped DESCRIPTION
+	size_t description_size;
+};
+
+enum ics_scan {
+	// The first component of the calendar is not a VJOURNAL
+	ICS_NOT_JOURNAL,
+	// The VJOURNAL does not end, I.E. the file is cut short
+	ICS_TRUNCATED,
+	ICS_JOURNAL,
+};
+
+// Scans the unfolded lines of the first VJOURNAL in buffer. header is
+// only complete for ICS_JOURNAL.
+enum ics_scan
+scan_ics_header(arena *ar, const char *buffer, size_t len,
+		struct ics_header *header);
+
 // Owner: ctx
 icalcomponent *
 parse_ics_file(arena *ar, const char *filename);
@@ -0,0 +1,68 @@
+#include "intern.h"
+#include "hashmap.h"
+#include "util.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct interned {
+	size_t refs;
+	char str[];
+};
+
+// Interned strings by themselves, the keys are the interned strings
+static struct hashmap *strings = NULL;
+static pthread_mutex_t strings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct interned *
+get_interned(const char *str)
+{
+	return (struct interned *)(str - offsetof(struct interned, str));
+}
+
+const char *
+intern(const char *str)
+{
+	pthread_mutex_lock(&strings_lock);
+	if (!strings) {
+		strings = hashmap_new_borrowing(NULL);
+	}
+
+	struct interned *interned = hashmap_get(strings, str);
+	if (!interned) {
+		size_t len = strlen(str);
+		interned = xmalloc(sizeof(struct interned) + len + 1);
+		interned->refs = 0;
+		memcpy(interned->str, str, len + 1);
+		hashmap_insert(strings, interned->str, interned);
+	}
+	interned->refs++;
+	pthread_mutex_unlock(&strings_lock);
+	return interned->str;
+}
+
+const char *
+retain_interned(const char *str)
+{
+	pthread_mutex_lock(&strings_lock);
+	get_interned(str)->refs++;
+	pthread_mutex_unlock(&strings_lock);
+	return str;
+}
+
+void
+release_interned(const char *str)
+{
+	if (!str) {
+		return;
+	}
+
+	pthread_mutex_lock(&strings_lock);
+	struct interned *interned = get_interned(str);
+	if (--interned->refs == 0) {
+		hashmap_remove(strings, interned->str);
+		free(interned);
+	}
+	pthread_mutex_unlock(&strings_lock);
+}
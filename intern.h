@@ -0,0 +1,21 @@
+#ifndef intern_h_INCLUDED
+#define intern_h_INCLUDED
+
+// Strings that many long lived objects share, like vdir names and UIDs,
+// are stored once. Equal interned strings have the same address, so they
+// can be compared by pointer and used as keys without copying them.
+// Interned strings are reference counted and must not be modified.
+
+// Returns the interned copy of str, to be released with release_interned
+const char *
+intern(const char *str);
+
+// Takes another reference to a string returned by intern
+const char *
+retain_interned(const char *str);
+
+// str may be NULL
+void
+release_interned(const char *str);
+
+#endif // intern_h_INCLUDED
@@ -1,17 +1,24 @@
 #define FUSE_USE_VERSION 31
 
+#include "change_hook.h"
+#include "changelog.h"
 #include "fuse_node.h"
 #include "fuse_node_store.h"
 #include "ical_extra.h"
 #include "arena.h"
+#include "body_cache.h"
 #include "tree.h"
 #include "util.h"
+#include "vdir_load.h"
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse3/fuse.h>
 #include <fuse3/fuse_lowlevel.h>
 #include <fuse3/fuse_opt.h>
+#include <inttypes.h>
 #include <libical/ical.h>
+#include <poll.h>
 #include <pthread.h>
 #include <regex.h>
 #include <stdbool.h>
@@ -34,36 +41,237 @@ static pthread_rwlock_t entries_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 #define FUSE_WRITE_BEGIN                                                       \
 	LOG("%s", __func__);                                                   \
+	wait_for_tree();                                                       \
 	pthread_rwlock_wrlock(&entries_lock);                                  \
-	arena *ar = create_arena();                                 \
+	arena *ar = acquire_thread_arena(__func__);                            \
 	int status = 0;                                                        \
-	if (!ar) {                                                           \
+	if (!ar) {                                                             \
 		pthread_rwlock_unlock(&entries_lock);                          \
 		return -ENOMEM;                                                \
 	}
 
 #define FUSE_READ_BEGIN                                                        \
 	LOG("%s", __func__);                                                   \
+	wait_for_tree();                                                       \
 	pthread_rwlock_rdlock(&entries_lock);                                  \
-	arena *ar = create_arena();                                 \
+	arena *ar = acquire_thread_arena(__func__);                            \
 	int status = 0;                                                        \
-	if (!ar) {                                                           \
+	if (!ar) {                                                             \
 		pthread_rwlock_unlock(&entries_lock);                          \
 		return -ENOMEM;                                                \
 	}
 
 #define FUSE_CLEANUP                                                           \
 	pthread_rwlock_unlock(&entries_lock);                                  \
-	free_all(ar);
+	release_thread_arena(ar);
+
+// Virtual files that are not backed by the vdir
+#define READY_XATTR "user.ready"
+#define CONTROL_DIR "/.agendafs"
+#define CHANGES_FILE CONTROL_DIR "/changes"
+#define MEMORY_FILE CONTROL_DIR "/memory"
+
+// An open handle of the change feed, or of a snapshot of the memory
+// statistics
+struct control_handle {
+	struct changelog_cursor cursor;
+	struct fuse_pollhandle *ph;
+	struct control_handle *next;
+	char *snapshot;
+	size_t snapshot_size;
+};
+
+static struct control_handle *change_readers = NULL;
+static pthread_mutex_t change_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+is_control_path(const char *path)
+{
+	return strcmp(path, CONTROL_DIR) == 0 ||
+	       starts_with_str(path, CONTROL_DIR "/");
+}
+
+// The feed starts at the oldest record that is kept, changes.<seq>
+// resumes after record seq.
+static bool
+parse_changes_path(const char *path, uint64_t *after)
+{
+	if (strcmp(path, CHANGES_FILE) == 0) {
+		*after = 0;
+		return true;
+	}
+	if (!starts_with_str(path, CHANGES_FILE ".")) {
+		return false;
+	}
+
+	const char *seq = path + strlen(CHANGES_FILE ".");
+	if (*seq < '0' || *seq > '9') {
+		return false;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	unsigned long long value = strtoull(seq, &end, 10);
+	if (errno != 0 || *end != '\0') {
+		return false;
+	}
+	*after = value;
+	return true;
+}
+
+static int
+control_getattr(const char *path, struct stat *stbuf)
+{
+	uint64_t after;
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+
+	if (strcmp(path, CONTROL_DIR) == 0) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	if (parse_changes_path(path, &after) ||
+	    (strcmp(path, MEMORY_FILE) == 0 && arena_stats_enabled())) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_mtime = time(NULL);
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int
+control_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+	if (strcmp(path, CONTROL_DIR) != 0) {
+		return -ENOTDIR;
+	}
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	filler(buf, get_filename(CHANGES_FILE), NULL, 0, 0);
+	if (arena_stats_enabled()) {
+		filler(buf, get_filename(MEMORY_FILE), NULL, 0, 0);
+	}
+	return 0;
+}
+
+// Statistics are taken when opening, so reading in chunks is consistent
+static int
+open_memory_file(struct fuse_file_info *fi)
+{
+	struct control_handle *handle =
+	    xcalloc(1, sizeof(struct control_handle));
+	handle->snapshot = format_arena_stats(&handle->snapshot_size);
+	if (!handle->snapshot) {
+		free(handle);
+		return -ENOMEM;
+	}
+
+	// The size is only known once opened
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t)handle;
+	return 0;
+}
+
+static int
+read_snapshot(const struct control_handle *handle, char *buf, size_t size,
+	      off_t offset)
+{
+	if (offset >= (off_t)handle->snapshot_size) {
+		return 0;
+	}
+	size_t available = handle->snapshot_size - offset;
+	size_t count = size < available ? size : available;
+	memcpy(buf, handle->snapshot + offset, count);
+	return count;
+}
+
+static int
+control_open(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t after;
+	bool is_memory_file =
+	    strcmp(path, MEMORY_FILE) == 0 && arena_stats_enabled();
+	if (!is_memory_file && !parse_changes_path(path, &after)) {
+		return -ENOENT;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	if (is_memory_file) {
+		return open_memory_file(fi);
+	}
+
+	struct control_handle *reader =
+	    xcalloc(1, sizeof(struct control_handle));
+	reader->cursor.seq = after;
+
+	pthread_mutex_lock(&change_readers_lock);
+	reader->next = change_readers;
+	change_readers = reader;
+	pthread_mutex_unlock(&change_readers_lock);
+
+	// Reads are served from the cursor, not the file offset
+	fi->direct_io = 1;
+	fi->nonseekable = 1;
+	fi->fh = (uintptr_t)reader;
+	return 0;
+}
+
+static int
+control_release(struct control_handle *reader)
+{
+	if (reader->snapshot) {
+		free(reader->snapshot);
+		free(reader);
+		return 0;
+	}
+
+	pthread_mutex_lock(&change_readers_lock);
+	for (struct control_handle **r = &change_readers; *r;
+	     r = &(*r)->next) {
+		if (*r == reader) {
+			*r = reader->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&change_readers_lock);
+
+	if (reader->ph) {
+		fuse_pollhandle_destroy(reader->ph);
+	}
+	free(reader);
+	return 0;
+}
+
+// Registered with the changelog, wakes up everyone waiting in poll
+static void
+notify_change_readers(void)
+{
+	pthread_mutex_lock(&change_readers_lock);
+	for (struct control_handle *r = change_readers; r; r = r->next) {
+		if (r->ph) {
+			fuse_notify_poll(r->ph);
+			fuse_pollhandle_destroy(r->ph);
+			r->ph = NULL;
+		}
+	}
+	pthread_mutex_unlock(&change_readers_lock);
+}
 
 static int
 fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 {
-	FUSE_READ_BEGIN;
-	LOG("%s", path);
+	if (is_control_path(path)) {
+		return control_getattr(path, stbuf);
+	}
 
 	memset(stbuf, 0, sizeof(struct stat));
 
+	// Answered while loading, so the mount can be checked right away
 	if (strcmp(path, "/") == 0) {
 		stbuf->st_mode = S_IFDIR | 0444;
 		stbuf->st_nlink = 2;
@@ -72,9 +280,12 @@ fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 		stbuf->st_uid = getuid();
 		stbuf->st_gid = getgid();
 		stbuf->st_ino = 0;
-		goto cleanup_return;
+		return 0;
 	}
 
+	FUSE_READ_BEGIN;
+	LOG("%s", path);
+
 	const struct tree_node *node = get_node_by_path(ar, path);
 	if (!node) {
 		LOG("Entry not found");
@@ -82,9 +293,7 @@ fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 		goto cleanup_return;
 	}
 
-	icalcomponent *ic = get_icalcomponent_from_node(ar, node);
-
-	struct stat st = get_node_stat(ar, node, ic);
+	struct stat st = get_node_stat(ar, node);
 
 	*stbuf = st;
 
@@ -107,6 +316,9 @@ static int
 fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	     struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
+	if (is_control_path(path)) {
+		return control_readdir(path, buf, filler);
+	}
 
 	FUSE_READ_BEGIN;
 	LOG("%s", path);
@@ -122,10 +334,7 @@ fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 
 	for (size_t i = 0; i < node->child_count; i++) {
 		const struct tree_node *child = node->children[i];
-		icalcomponent *ic = get_icalcomponent_from_node(ar, child);
-		assert(ic);
-
-		struct stat st = get_node_stat(ar, node, ic);
+		struct stat st = get_node_stat(ar, child);
 
 		if (filler(buf, get_node_filename(child), &st, 0, 0) != 0) {
 			status = -ENOMEM;
@@ -141,14 +350,17 @@ cleanup_return:
 static int
 fuse_open(const char *path, struct fuse_file_info *fi)
 {
-	FUSE_READ_BEGIN;
-	LOG("%s", path);
-	const struct tree_node *node = get_node_by_path(ar, path);
-	if (!node) {
-		status = -ENOENT;
+	if (is_control_path(path)) {
+		return control_open(path, fi);
 	}
 
-	FUSE_CLEANUP;
+	// Only looks the path up, so it needs no arena
+	LOG("%s", __func__);
+	wait_for_tree();
+	pthread_rwlock_rdlock(&entries_lock);
+	LOG("%s", path);
+	int status = get_node_by_path(NULL, path) ? 0 : -ENOENT;
+	pthread_rwlock_unlock(&entries_lock);
 	return status;
 }
 
@@ -158,7 +370,7 @@ fuse_mkdir(const char *filepath, mode_t mode)
 	FUSE_WRITE_BEGIN;
 
 	// Reserved
-	if (pathIsHidden(filepath)) {
+	if (pathIsHidden(filepath) || is_control_path(filepath)) {
 		status = -EPERM;
 		goto cleanup_return;
 	}
@@ -180,6 +392,14 @@ static int
 fuse_read(const char *path, char *buf, size_t size, off_t offset,
 	  struct fuse_file_info *fi)
 {
+	if (fi && fi->fh) {
+		struct control_handle *reader = (struct control_handle *)fi->fh;
+		if (reader->snapshot) {
+			return read_snapshot(reader, buf, size, offset);
+		}
+		return changelog_read(&reader->cursor, buf, size);
+	}
+
 	FUSE_READ_BEGIN;
 
 	LOG("READ: offset=%ld, size=%zu", offset, size);
@@ -189,6 +409,26 @@ fuse_read(const char *path, char *buf, size_t size, off_t offset,
 		status = -ENOENT;
 		goto cleanup_return;
 	}
+	if (is_root_node(n)) {
+		status = -EIO;
+		goto cleanup_return;
+	}
+
+	// Reading a note in chunks only parses it for the first one
+	const char *filename_vdir = get_entry(n)->filename_vdir;
+	struct stat st;
+	bool has_stat = stat(get_vdir_filepath(ar, n), &st) == 0;
+	struct vdir_fingerprint fp;
+	if (has_stat) {
+		fp = vdir_fingerprint_from_stat(&st);
+		ssize_t cached =
+		    body_cache_read(filename_vdir, &fp, buf, size, offset);
+		if (cached >= 0) {
+			status = cached;
+			goto cleanup_return;
+		}
+	}
+
 	icalcomponent *ic = get_icalcomponent_from_node(ar, n);
 	if (!ic) {
 		status = -EIO;
@@ -196,6 +436,9 @@ fuse_read(const char *path, char *buf, size_t size, off_t offset,
 	}
 
 	const char *description = icalcomponent_get_description(ic);
+	if (has_stat) {
+		body_cache_store(filename_vdir, &fp, description);
+	}
 	if (!description) {
 		goto cleanup_return;
 	}
@@ -317,6 +560,11 @@ fuse_rename(const char *old, const char *new, unsigned int flags)
 	FUSE_WRITE_BEGIN;
 	LOG("%s -> %s", old, new);
 
+	if (is_control_path(old) || is_control_path(new)) {
+		status = -EPERM;
+		goto cleanup_return;
+	}
+
 	struct tree_node *existing_node = get_node_by_path(ar, new);
 	if (existing_node) {
 		if (node_has_children(existing_node)) {
@@ -344,7 +592,7 @@ fuse_create(const char *filepath, mode_t mode, struct fuse_file_info *info)
 	LOG("%s", filepath);
 
 	// Reserved
-	if (pathIsHidden(filepath)) {
+	if (pathIsHidden(filepath) || is_control_path(filepath)) {
 		status = -EPERM;
 		goto cleanup_return;
 	}
@@ -598,6 +846,19 @@ cleanup_return_2:
 static int
 fuse_getxattr(const char *path, const char *attribute, char *buf, size_t s)
 {
+	if (strcmp(path, "/") == 0 && strcmp(attribute, READY_XATTR) == 0) {
+		const char *ready = is_tree_loaded() ? "1" : "0";
+		size_t len = strlen(ready);
+		// Values are not null terminated, s == 0 asks for the size
+		if (s > 0) {
+			if (s < len) {
+				return -ERANGE;
+			}
+			memcpy(buf, ready, len);
+		}
+		return len;
+	}
+
 	FUSE_READ_BEGIN;
 	LOG("'%s' '%s' '%zu'\n", path, attribute, s);
 
@@ -724,35 +985,195 @@ cleanup_return:
 	return status;
 }
 
+#define VDIR_WATCH_MASK                                                        \
+	(IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM)
+
+// One watch per collection, all on the same inotify instance
+struct collection_watch {
+	int wd;
+	char *collection;
+};
+
+static struct collection_watch *collection_watches = NULL;
+static size_t collection_watch_count = 0;
+
 static void
-handle_vdir_event(struct inotify_event *event)
+watch_collection(arena *ar, int fd, const char *collection)
 {
-	if (!event->len || !strstr(event->name, ".ics"))
+	const char *dirpath = append_path(ar, VDIR, collection);
+	int wd = inotify_add_watch(fd, dirpath, VDIR_WATCH_MASK);
+	if (wd < 0) {
+		perror("inotify_add_watch");
 		return;
+	}
 
-	arena *ar = create_arena();
-	pthread_rwlock_wrlock(&entries_lock);
+	// Watching the same directory twice returns the same descriptor,
+	// its collection is renamed if the directory was moved
+	for (size_t i = 0; i < collection_watch_count; i++) {
+		if (collection_watches[i].wd == wd) {
+			free(collection_watches[i].collection);
+			collection_watches[i].collection = xstrdup(collection);
+			return;
+		}
+	}
 
-	LOG("Detected change in ICS file: %s\n", event->name);
+	collection_watches =
+	    xreallocarray(collection_watches, collection_watch_count + 1,
+			  sizeof(struct collection_watch));
+	collection_watches[collection_watch_count].wd = wd;
+	collection_watches[collection_watch_count].collection =
+	    xstrdup(collection);
+	collection_watch_count++;
+}
 
-	char *full_path = NULL;
-	rasprintf(ar, &full_path, "%s/%s", VDIR, event->name);
+static const char *
+get_watched_collection(int wd)
+{
+	for (size_t i = 0; i < collection_watch_count; i++) {
+		if (collection_watches[i].wd == wd) {
+			return collection_watches[i].collection;
+		}
+	}
+	return NULL;
+}
 
-	if (event->mask & IN_DELETE) {
-		LOG("IN_DELETE HOOK");
-		delete_from_vdir_path(ar, full_path);
+static void
+unwatch_collection(int wd)
+{
+	for (size_t i = 0; i < collection_watch_count; i++) {
+		if (collection_watches[i].wd == wd) {
+			free(collection_watches[i].collection);
+			collection_watches[i] =
+			    collection_watches[--collection_watch_count];
+			return;
+		}
 	}
-	else if (event->mask & IN_MODIFY) {
-		LOG("IN_MODIFY HOOK");
-		update_or_create_fuse_entry_from_vdir(ar, full_path);
+}
+
+// Stops watching collection and the collections below it
+static void
+unwatch_collections_in(int fd, const char *collection)
+{
+	for (size_t i = 0; i < collection_watch_count;) {
+		if (is_in_collection(collection_watches[i].collection,
+				     collection)) {
+			// Fails for a removed directory, its watch is gone
+			inotify_rm_watch(fd, collection_watches[i].wd);
+			free(collection_watches[i].collection);
+			collection_watches[i] =
+			    collection_watches[--collection_watch_count];
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+static void
+publish_changed_vdir_file(arena *ar, const char *filename_vdir)
+{
+	// Read and parse without blocking readers, the lock is only
+	// taken to link the result into the tree.
+	struct parsed_entry *parsed = parse_vdir_entry(ar, filename_vdir);
+	if (parsed) {
+		pthread_rwlock_wrlock(&entries_lock);
+		publish_vdir_entry(ar, parsed);
+		pthread_rwlock_unlock(&entries_lock);
+	}
+}
+
+// A collection created after mounting. Entries might already have been
+// written to it before the watch was in place, so it is scanned too.
+static void
+add_new_collection(arena *ar, int fd, const char *collection)
+{
+	LOG("New collection %s", collection);
+	pthread_rwlock_wrlock(&entries_lock);
+	add_vdir_collection(collection);
+	pthread_rwlock_unlock(&entries_lock);
+
+	watch_collection(ar, fd, collection);
+
+	DIR *dir = opendir(append_path(ar, VDIR, collection));
+	if (!dir) {
+		return;
 	}
-	else if (event->mask & IN_CREATE) {
-		LOG("IN_CREATE HOOK");
-		update_or_create_fuse_entry_from_vdir(ar, full_path);
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (pathIsHidden(entry->d_name)) {
+			continue;
+		}
+		char *child = vdir_child_path(ar, collection, entry->d_name);
+		if (entry->d_type == DT_DIR) {
+			add_new_collection(ar, fd, child);
+		}
+		else if (entry->d_type == DT_REG &&
+			 strstr(entry->d_name, ".ics")) {
+			publish_changed_vdir_file(ar, child);
+		}
 	}
+	closedir(dir);
+}
 
+// A collection that was removed or moved. A collection moved inside the
+// vdir is added again by the IN_MOVED_TO event of its new name.
+static void
+remove_collection(arena *ar, int fd, const char *collection)
+{
+	LOG("Removed collection %s", collection);
+	unwatch_collections_in(fd, collection);
+	pthread_rwlock_wrlock(&entries_lock);
+	delete_vdir_collection(ar, collection);
 	pthread_rwlock_unlock(&entries_lock);
-	free_all(ar);
+}
+
+static void
+handle_vdir_event(int fd, struct inotify_event *event)
+{
+	if (event->mask & IN_IGNORED) {
+		unwatch_collection(event->wd);
+		return;
+	}
+
+	const char *collection = get_watched_collection(event->wd);
+	if (!event->len || !collection || pathIsHidden(event->name))
+		return;
+
+	arena *ar = acquire_thread_arena(__func__);
+	char *filename_vdir = vdir_child_path(ar, collection, event->name);
+
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			add_new_collection(ar, fd, filename_vdir);
+		}
+		else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			remove_collection(ar, fd, filename_vdir);
+		}
+		release_thread_arena(ar);
+		return;
+	}
+
+	if (!strstr(event->name, ".ics")) {
+		release_thread_arena(ar);
+		return;
+	}
+
+	LOG("Detected change in ICS file: %s\n", filename_vdir);
+
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		LOG("IN_DELETE HOOK");
+		forget_vdir_file(filename_vdir);
+		pthread_rwlock_wrlock(&entries_lock);
+		delete_from_vdir_path(ar, filename_vdir);
+		pthread_rwlock_unlock(&entries_lock);
+	}
+	else if (event->mask & (IN_MODIFY | IN_CREATE | IN_MOVED_TO)) {
+		LOG("IN_MODIFY/IN_CREATE HOOK");
+		publish_changed_vdir_file(ar, filename_vdir);
+	}
+
+	release_thread_arena(ar);
 }
 
 static void *
@@ -761,8 +1182,12 @@ watch_vdir_changes(void *arg)
 	int fd = inotify_init1(IN_NONBLOCK);
 	assert(fd >= 0);
 
-	int wd = inotify_add_watch(fd, VDIR, IN_CREATE | IN_MODIFY | IN_DELETE);
-	assert(wd >= 0);
+	arena *ar = create_arena();
+	for (size_t i = 0; i < vdir_collection_count(); i++) {
+		watch_collection(ar, fd, get_vdir_collection(i));
+	}
+	free_all(ar);
+	assert(collection_watch_count > 0);
 
 	char buffer[EVENT_BUF_LEN];
 
@@ -780,7 +1205,7 @@ watch_vdir_changes(void *arg)
 		while (i < length) {
 			struct inotify_event *event =
 			    (struct inotify_event *)&buffer[i];
-			handle_vdir_event(event);
+			handle_vdir_event(fd, event);
 			size_t event_size =
 			    sizeof(struct inotify_event) + event->len;
 
@@ -788,11 +1213,49 @@ watch_vdir_changes(void *arg)
 		}
 	}
 
-	inotify_rm_watch(fd, wd);
 	close(fd);
 	return NULL;
 }
 
+static int
+fuse_release(const char *path, struct fuse_file_info *fi)
+{
+	if (fi->fh) {
+		return control_release((struct control_handle *)fi->fh);
+	}
+	return 0;
+}
+
+static int
+fuse_poll(const char *path, struct fuse_file_info *fi,
+	  struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct control_handle *reader = (struct control_handle *)fi->fh;
+	if (!reader || reader->snapshot) {
+		// Notes are always ready
+		if (ph) {
+			fuse_pollhandle_destroy(ph);
+		}
+		*reventsp |= POLLIN | POLLOUT;
+		return 0;
+	}
+
+	// The handle is stored before checking, so a record that is added
+	// in between still triggers a notification.
+	pthread_mutex_lock(&change_readers_lock);
+	if (ph) {
+		if (reader->ph) {
+			fuse_pollhandle_destroy(reader->ph);
+		}
+		reader->ph = ph;
+	}
+	if (changelog_has_unread(&reader->cursor)) {
+		*reventsp |= POLLIN;
+	}
+	pthread_mutex_unlock(&change_readers_lock);
+	return 0;
+}
+
 // Ignore for now
 static int
 fuse_utimens(const char *path, const struct timespec tv[2],
@@ -804,6 +1267,15 @@ fuse_utimens(const char *path, const struct timespec tv[2],
 struct agendafs_config {
 	char *ics_directory;
 	char *default_file_extension;
+	char *default_collection;
+	char *on_change;
+	char *on_change_delay;
+	char *startup_threads;
+	int no_index;
+	int background_load;
+	char *body_cache;
+	int arena_stats;
+	unsigned long on_change_delay_ms;
 };
 enum {
 	KEY_HELP,
@@ -815,12 +1287,35 @@ enum {
 static struct fuse_opt agendafs_opts[] = {
     CUSTOMFS_OPT("ext=%s", default_file_extension, 0),
     CUSTOMFS_OPT("vdir=%s", ics_directory, 0),
+    CUSTOMFS_OPT("collection=%s", default_collection, 0),
+    CUSTOMFS_OPT("on_change=%s", on_change, 0),
+    CUSTOMFS_OPT("on_change_delay=%s", on_change_delay, 0),
+    CUSTOMFS_OPT("startup_threads=%s", startup_threads, 0),
+    CUSTOMFS_OPT("noindex", no_index, 1),
+    CUSTOMFS_OPT("background_load", background_load, 1),
+    CUSTOMFS_OPT("body_cache=%s", body_cache, 0),
+    CUSTOMFS_OPT("arena_stats", arena_stats, 1),
     FUSE_OPT_KEY("-V", KEY_VERSION),
     FUSE_OPT_KEY("--version", KEY_VERSION),
     FUSE_OPT_KEY("-h", KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
     FUSE_OPT_END};
 
+// A directory below VDIR that is loaded as a collection
+static bool
+is_valid_collection(const char *collection)
+{
+	if (collection[0] == '.' || strstr(collection, "/.")) {
+		return false;
+	}
+
+	char collection_path[PATH_MAX];
+	snprintf(collection_path, sizeof(collection_path), "%s/%s", VDIR,
+		 collection);
+	struct stat st;
+	return stat(collection_path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
 size_t
 load_agendafs_environment(char *vdir_env)
 {
@@ -846,7 +1341,62 @@ load_agendafs_environment(char *vdir_env)
 	return -1;
 }
 
-struct fuse_operations fuse_oper = {.getattr = fuse_getattr,
+static pthread_t watcher_thread;
+static bool watcher_started = false;
+static pthread_t loader_thread;
+static bool loader_started = false;
+
+static void
+start_vdir_watcher(void)
+{
+	if (pthread_create(&watcher_thread, NULL, watch_vdir_changes, NULL) !=
+	    0) {
+		perror("Failed to create inotify watcher thread");
+		return;
+	}
+	watcher_started = true;
+}
+
+static void *
+load_tree_in_background(void *arg)
+{
+	struct load_stats load_stats;
+	load_root_node_tree(&load_stats);
+	print_load_stats(&load_stats);
+	start_vdir_watcher();
+	return NULL;
+}
+
+// Threads are started here rather than in main, as fuse_main forks
+// when running in the background
+static void *
+fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	struct agendafs_config *conf = fuse_get_context()->private_data;
+
+	if (conf->background_load) {
+		if (pthread_create(&loader_thread, NULL,
+				   load_tree_in_background, NULL) != 0) {
+			perror("Failed to create loader thread");
+			exit(1);
+		}
+		loader_started = true;
+	}
+	else {
+		start_vdir_watcher();
+	}
+
+	if (conf->on_change &&
+	    start_change_hook(conf->on_change, conf->on_change_delay_ms) !=
+		0) {
+		perror("Failed to create on_change thread");
+	}
+
+	return conf;
+}
+
+struct fuse_operations fuse_oper = {.init = fuse_init,
+				    .getattr = fuse_getattr,
 				    .readdir = fuse_readdir,
 				    .open = fuse_open,
 				    .read = fuse_read,
@@ -861,6 +1411,8 @@ struct fuse_operations fuse_oper = {.getattr = fuse_getattr,
 				    .removexattr = fuse_removexattr,
 				    .rmdir = fuse_rmdir,
 				    .readlink = fuse_readlink,
+				    .release = fuse_release,
+				    .poll = fuse_poll,
 				    .rename = fuse_rename};
 
 static int
@@ -891,8 +1443,6 @@ agendafs_opt_proc(void *data, const char *arg, int key,
 int
 main(int argc, char *argv[])
 {
-	pthread_t watcher_thread;
-
 	tzset();
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -942,23 +1492,77 @@ main(int argc, char *argv[])
 
 	LOG("LOADED ICS DIR");
 
-	load_root_node_tree();
+	if (conf.default_collection) {
+		set_default_collection(conf.default_collection);
+	}
 
-	if (pthread_create(&watcher_thread, NULL, watch_vdir_changes, NULL) !=
-	    0) {
-		perror("Failed to create inotify watcher thread");
-		return 1;
+	conf.on_change_delay_ms = 5000;
+	if (conf.on_change_delay &&
+	    parse_duration_ms(conf.on_change_delay, &conf.on_change_delay_ms) !=
+		0) {
+		fprintf(stderr, "Invalid on_change_delay: %s\n",
+			conf.on_change_delay);
+		exit(1);
 	}
 
-	int ret = fuse_main(args.argc, args.argv, &fuse_oper, NULL);
+	if (conf.startup_threads) {
+		char *end;
+		long threads = strtol(conf.startup_threads, &end, 10);
+		if (*end != '\0' || threads < 0) {
+			fprintf(stderr, "Invalid startup_threads: %s\n",
+				conf.startup_threads);
+			exit(1);
+		}
+		set_startup_threads(threads);
+	}
+
+	set_vdir_index_enabled(!conf.no_index);
+	set_arena_stats_enabled(conf.arena_stats);
+
+	if (conf.body_cache) {
+		size_t budget;
+		if (parse_size(conf.body_cache, &budget) != 0) {
+			fprintf(stderr, "Invalid body_cache: %s\n",
+				conf.body_cache);
+			exit(1);
+		}
+		set_body_cache_budget(budget);
+	}
+
+	// Checked before loading, which may happen after mounting
+	if (conf.default_collection &&
+	    !is_valid_collection(conf.default_collection)) {
+		fprintf(stderr, "No collection %s in vdir\n",
+			conf.default_collection);
+		exit(1);
+	}
+
+	if (!conf.background_load) {
+		struct load_stats load_stats;
+		load_root_node_tree(&load_stats);
+		print_load_stats(&load_stats);
+	}
+	changelog_set_notify(notify_change_readers);
+
+	int ret = fuse_main(args.argc, args.argv, &fuse_oper, &conf);
 	LOG("Cleaning up");
 
-	pthread_cancel(watcher_thread);
-	pthread_join(watcher_thread, NULL);
-	LOG("Pthread freed");
+	if (loader_started) {
+		pthread_join(loader_thread, NULL);
+	}
+	if (watcher_started) {
+		pthread_cancel(watcher_thread);
+		pthread_join(watcher_thread, NULL);
+		LOG("Pthread freed");
+	}
 
-	hashmap_free(entries_vdir);
-	free_tree(fuse_root);
+	stop_change_hook();
+
+	if (is_tree_loaded()) {
+		hashmap_free(entries_vdir);
+		hashmap_free(entries_uid);
+		free_tree(fuse_root);
+	}
 	LOG("Hashmap and tree freed");
 
 	exit(ret);
@@ -1,11 +1,17 @@
 #include "path.h"
 #include "arena.h"
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 path *
 without_file_extension(arena *m, const path *p)
@@ -43,9 +49,8 @@ path *
 append_path(arena *m, const path *parentp, const char *childp)
 {
 	char *filepath = NULL;
-	size_t res = asprintf(&filepath, "%s/%s", parentp, childp);
+	int res = rasprintf(m, &filepath, "%s/%s", parentp, childp);
 	assert(res != -1);
-	arena_register(m, filepath, free);
 	return filepath;
 }
 
@@ -94,16 +99,55 @@ split_path(arena *m, const path *p, char **segments)
 	return count;
 }
 
+// The content goes to a hidden file next to filepath first, which then
+// replaces it. Readers like the vdir watcher never see a partial file.
 size_t
 write_to_file(const path *filepath, const char *content)
 {
-	FILE *f = fopen(filepath, "w");
-	if (!f) {
+	static atomic_ulong tmp_count = 0;
+
+	const char *name = strrchr(filepath, '/');
+	int dir_len = name ? (int)(name - filepath + 1) : 0;
+	char tmp_path[PATH_MAX];
+	int len = snprintf(tmp_path, sizeof(tmp_path), "%.*s.%s.%d.%lu.tmp",
+			   dir_len, filepath, name ? name + 1 : filepath,
+			   (int)getpid(), atomic_fetch_add(&tmp_count, 1));
+	if (len < 0 || (size_t)len >= sizeof(tmp_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd == -1) {
 		perror("Failed to open file");
 		return -EIO;
 	}
-	fputs(content, f);
-	fclose(f);
+
+	// Keeps the permissions of the file that is replaced
+	struct stat st;
+	if (stat(filepath, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+	}
+
+	size_t size = strlen(content);
+	size_t written = 0;
+	while (written < size) {
+		ssize_t n = write(fd, content + written, size - written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		written += n;
+	}
+
+	bool ok = written == size && fsync(fd) == 0;
+	ok &= close(fd) == 0;
+	if (!ok || rename(tmp_path, filepath) != 0) {
+		perror("Failed to write file");
+		unlink(tmp_path);
+		return -EIO;
+	}
 	return 0;
 }
 
@@ -134,3 +178,40 @@ filename_numbered(const char *filename, size_t n)
 	return new_filename;
 }
 
+// Start of a ".<number>" that ends at end, NULL if there is none
+static const char *
+number_suffix(const char *filename, const char *end, size_t *n)
+{
+	const char *digits = end;
+	while (digits > filename && isdigit((unsigned char)digits[-1])) {
+		digits--;
+	}
+	if (digits == end || digits - 1 <= filename || digits[-1] != '.') {
+		return NULL;
+	}
+	*n = strtoull(digits, NULL, 10);
+	return digits - 1;
+}
+
+// The reverse of filename_numbered
+// my-file.1.txt -> my-file.txt, n is 1
+// NULL if filename is not numbered, caller is responsible for freeing memory
+path *
+filename_unnumbered(const char *filename, size_t *n)
+{
+	const char *ext = strrchr(filename, '.');
+	const char *dot = ext ? number_suffix(filename, ext, n) : NULL;
+	if (!dot) {
+		ext = "";
+		dot = number_suffix(filename, filename + strlen(filename), n);
+	}
+	if (!dot) {
+		return NULL;
+	}
+
+	size_t base_len = dot - filename;
+	char *base = xmalloc(base_len + strlen(ext) + 1);
+	memcpy(base, filename, base_len);
+	strcpy(base + base_len, ext);
+	return base;
+}
@@ -38,4 +38,7 @@ write_to_file(const path *filepath, const char *content);
 path *
 filename_numbered(const char *filename, size_t n);
 
+path *
+filename_unnumbered(const char *filename, size_t *n);
+
 #endif // path_h_INCLUDED
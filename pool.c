@@ -0,0 +1,47 @@
+#include "pool.h"
+#include "util.h"
+#include <stdlib.h>
+
+void *
+pool_alloc(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	void *object = pool->free_list;
+	if (object) {
+		pool->free_list = *(void **)object;
+	}
+	else {
+		if (pool->next == pool->end) {
+			size_t size = pool->object_size * pool->objects_per_slab;
+			pool->next = xmalloc(size);
+			pool->end = pool->next + size;
+			pool->slab_count++;
+		}
+		object = pool->next;
+		pool->next += pool->object_size;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return object;
+}
+
+void
+pool_free(struct pool *pool, void *object)
+{
+	if (!object) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	*(void **)object = pool->free_list;
+	pool->free_list = object;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+size_t
+pool_size(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	size_t size = pool->slab_count * pool->object_size *
+		      pool->objects_per_slab;
+	pthread_mutex_unlock(&pool->lock);
+	return size;
+}
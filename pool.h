@@ -0,0 +1,40 @@
+#ifndef pool_h_INCLUDED
+#define pool_h_INCLUDED
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Fixed size objects, carved from slabs that are never returned to the
+ * system. Freed objects are reused first, so objects allocated together
+ * are close in memory and there is no per object malloc header.
+ */
+struct pool {
+	size_t object_size;
+	size_t objects_per_slab;
+	void *free_list;
+	// Unused objects at the end of the newest slab
+	char *next;
+	char *end;
+	size_t slab_count;
+	pthread_mutex_t lock;
+};
+
+#define POOL_INITIALIZER(type, per_slab)                                       \
+	{                                                                      \
+	    .object_size = sizeof(type) < sizeof(void *) ? sizeof(void *)      \
+							 : sizeof(type),       \
+	    .objects_per_slab = (per_slab),                                    \
+	    .lock = PTHREAD_MUTEX_INITIALIZER,                                 \
+	}
+
+void *
+pool_alloc(struct pool *pool);
+
+void
+pool_free(struct pool *pool, void *object);
+
+// Bytes taken from the system
+size_t
+pool_size(struct pool *pool);
+
+#endif // pool_h_INCLUDED
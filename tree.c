@@ -1,14 +1,18 @@
 #include "tree.h"
 #include "arena.h"
+#include "pool.h"
 #include "util.h"
+#include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
+static struct pool node_pool = POOL_INITIALIZER(struct tree_node, 1024);
+
 struct tree_node *
 create_tree_node(void *data, void (*free_fn)(void *))
 {
-	struct tree_node *node = xmalloc(sizeof(struct tree_node));
+	struct tree_node *node = pool_alloc(&node_pool);
 	if (!node)
 		return NULL;
 	node->data = data;
@@ -16,6 +20,7 @@ create_tree_node(void *data, void (*free_fn)(void *))
 	node->children = NULL;
 	node->child_count = 0;
 	node->child_capacity = 0;
+	node->child_index = 0;
 	node->free_fn = free_fn;
 
 	return node;
@@ -32,6 +37,7 @@ rcreate_tree_node(void *data, arena *m)
 	node->children = NULL;
 	node->child_count = 0;
 	node->child_capacity = 0;
+	node->child_index = 0;
 	node->free_fn = NULL;
 
 	return node;
@@ -41,13 +47,14 @@ size_t
 add_child(struct tree_node *parent, struct tree_node *child)
 {
 	if (parent->child_count == parent->child_capacity) {
-		size_t new_capacity =
+		uint32_t new_capacity =
 		    parent->child_capacity ? parent->child_capacity * 2 : 4;
 
 		parent->children = xreallocarray(parent->children, new_capacity,
 						 sizeof(struct tree_node *));
 		parent->child_capacity = new_capacity;
 	}
+	child->child_index = parent->child_count;
 	parent->children[parent->child_count++] = child;
 	child->parent = parent;
 	return 0;
@@ -80,7 +87,13 @@ free_tree(struct tree_node *node)
 		node->free_fn(node->data);
 	}
 	free(node->children);
-	free(node);
+	pool_free(&node_pool, node);
+}
+
+size_t
+tree_node_pool_size(void)
+{
+	return pool_size(&node_pool);
 }
 
 void
@@ -105,21 +118,12 @@ detach_tree_node(struct tree_node *node)
 		return false;
 
 	struct tree_node *parent = node->parent;
+	assert(parent->children[node->child_index] == node);
 
-	// Find index of this node in parent->children
-	size_t index = (size_t)-1;
-	for (size_t i = 0; i < parent->child_count; ++i) {
-		if (parent->children[i] == node) {
-			index = i;
-			break;
-		}
-	}
-
-	// Shift remaining children to fill the gap
-	for (size_t i = index + 1; i < parent->child_count; ++i) {
-		parent->children[i - 1] = parent->children[i];
-	}
-	parent->child_count--;
+	// Children are not ordered, so the last one fills the gap
+	struct tree_node *last = parent->children[--parent->child_count];
+	parent->children[node->child_index] = last;
+	last->child_index = node->child_index;
 
 	node->parent = NULL;
 	return true;
@@ -3,15 +3,20 @@
 
 #include "arena.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+// Nodes from create_tree_node are taken from a pool, so nodes created
+// together, like the ones of a directory, are next to each other.
 struct tree_node {
 	void *data;
 
 	struct tree_node *parent;
 	struct tree_node **children;
-	size_t child_count;
-	size_t child_capacity;
+	uint32_t child_count;
+	uint32_t child_capacity;
+	// Position in parent->children
+	uint32_t child_index;
 
 	void (*free_fn)(void *);
 };
@@ -31,7 +36,7 @@ move_node(struct tree_node *new_parent, struct tree_node *child);
 void
 update_node_data(struct tree_node *node, void *data);
 
-// detach from parent
+// detach from parent, the last sibling takes the place of the node
 bool
 detach_tree_node(struct tree_node *node);
 
@@ -44,5 +49,9 @@ free_tree(struct tree_node *node);
 void
 print_tree(struct tree_node *node, int depth, void (*print_data)(void *));
 
+// Bytes held by the pool of nodes
+size_t
+tree_node_pool_size(void);
+
 #endif
 
@@ -0,0 +1,394 @@
+#include "vdir_index.h"
+#include "hashmap.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bump when the layout or the meaning of a field changes
+#define INDEX_VERSION 2
+#define INDEX_MAGIC "AGFSIDX"
+// Offset of a missing string
+#define INDEX_NO_STRING UINT32_MAX
+
+#define INDEX_FLAG_REJECTED 1
+#define INDEX_FLAG_DIRECTORY 2
+
+// The file is the header, count records and then null terminated
+// strings, referenced by their offset.
+struct index_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t count;
+	uint64_t strings_size;
+	// Files changed in the same second as the index was written may
+	// change again without a new mtime, so they are not trusted
+	int64_t written_sec;
+	uint32_t vdir;
+	uint32_t padding;
+};
+
+struct index_record {
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t description_size;
+	uint32_t filename_vdir;
+	uint32_t summary;
+	uint32_t uid;
+	uint32_t parent_uid;
+	uint32_t file_extension;
+	uint32_t flags;
+};
+
+struct vdir_index {
+	void *map;
+	size_t map_size;
+	const struct index_file_header *header;
+	const struct index_record *records;
+	const char *strings;
+	// filename_vdir to record
+	struct hashmap *by_name;
+};
+
+struct vdir_index_builder {
+	struct index_record *records;
+	size_t count;
+	size_t capacity;
+	char *strings;
+	size_t strings_size;
+	size_t strings_capacity;
+};
+
+static uint32_t
+hash_vdir(const char *vdir)
+{
+	uint32_t hash = 0x811C9DC5;
+	for (const char *c = vdir; *c; c++) {
+		hash = (hash ^ (unsigned char)*c) * 0x01000193;
+	}
+	return hash;
+}
+
+// The same vdir can be given as different paths, I.E. through a symlink
+static const char *
+get_real_vdir(char *buf)
+{
+	return realpath(VDIR, buf) ? buf : VDIR;
+}
+
+// Each vdir has its own index, named after a hash of its real path
+static int
+get_index_path(char *index_path, size_t size, bool create_dir)
+{
+	char cache_dir[PATH_MAX];
+	const char *xdg_cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg_cache && *xdg_cache) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/agendafs",
+			 xdg_cache);
+	}
+	else if (home && *home) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/agendafs",
+			 home);
+	}
+	else {
+		return -1;
+	}
+
+	if (create_dir) {
+		char *parent = strrchr(cache_dir, '/');
+		*parent = '\0';
+		mkdir(cache_dir, 0700);
+		*parent = '/';
+		if (mkdir(cache_dir, 0700) != 0 && errno != EEXIST) {
+			return -1;
+		}
+	}
+
+	char real_vdir[PATH_MAX];
+	int len = snprintf(index_path, size, "%s/%08x.index", cache_dir,
+			   hash_vdir(get_real_vdir(real_vdir)));
+	return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+static const char *
+index_string(const struct vdir_index *index, uint32_t offset)
+{
+	return offset == INDEX_NO_STRING ? NULL : index->strings + offset;
+}
+
+// Everything is checked once, so lookups can trust the mapping
+static bool
+is_valid_index(struct vdir_index *index)
+{
+	const struct index_file_header *header = index->header;
+	if (index->map_size < sizeof(struct index_file_header) ||
+	    memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+	    header->version != INDEX_VERSION ||
+	    header->record_size != sizeof(struct index_record)) {
+		return false;
+	}
+
+	size_t available = index->map_size - sizeof(struct index_file_header);
+	if (header->count > available / sizeof(struct index_record)) {
+		return false;
+	}
+	available -= header->count * sizeof(struct index_record);
+	index->strings = (const char *)(index->records + header->count);
+	if (header->strings_size != available || available == 0 ||
+	    index->strings[available - 1] != '\0') {
+		return false;
+	}
+
+	for (size_t i = 0; i < header->count; i++) {
+		const struct index_record *record = &index->records[i];
+		uint32_t offsets[] = {record->filename_vdir, record->summary,
+				      record->uid, record->parent_uid,
+				      record->file_extension};
+		for (size_t j = 0; j < sizeof(offsets) / sizeof(*offsets);
+		     j++) {
+			if (offsets[j] != INDEX_NO_STRING &&
+			    offsets[j] >= available) {
+				return false;
+			}
+		}
+		if (record->filename_vdir == INDEX_NO_STRING) {
+			return false;
+		}
+	}
+
+	char real_vdir[PATH_MAX];
+	return header->vdir < available &&
+	       strcmp(index->strings + header->vdir,
+		      get_real_vdir(real_vdir)) == 0;
+}
+
+struct vdir_index *
+open_vdir_index(void)
+{
+	char index_path[PATH_MAX];
+	if (get_index_path(index_path, sizeof(index_path), false) != 0) {
+		return NULL;
+	}
+
+	int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		LOG("No index at %s", index_path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct vdir_index *index = xcalloc(1, sizeof(struct vdir_index));
+	index->map = map;
+	index->map_size = st.st_size;
+	index->header = map;
+	index->records =
+	    (const struct index_record *)((const char *)map +
+					  sizeof(struct index_file_header));
+
+	if (!is_valid_index(index)) {
+		LOG("Ignoring outdated index %s", index_path);
+		munmap(map, st.st_size);
+		free(index);
+		return NULL;
+	}
+
+	// The keys are the strings of the mapping, which outlives the map
+	index->by_name = hashmap_new_borrowing(NULL);
+	hashmap_reserve(index->by_name, index->header->count);
+	for (size_t i = 0; i < index->header->count; i++) {
+		const struct index_record *record = &index->records[i];
+		hashmap_insert(index->by_name,
+			       index_string(index, record->filename_vdir),
+			       (void *)record);
+	}
+
+	return index;
+}
+
+void
+close_vdir_index(struct vdir_index *index)
+{
+	if (!index) {
+		return;
+	}
+	hashmap_free(index->by_name);
+	munmap(index->map, index->map_size);
+	free(index);
+}
+
+enum index_lookup
+vdir_index_lookup(const struct vdir_index *index, const char *filename_vdir,
+		  const struct vdir_fingerprint *fp, struct ics_header *header)
+{
+	if (!index) {
+		return INDEX_MISS;
+	}
+
+	const struct index_record *record =
+	    hashmap_get(index->by_name, filename_vdir);
+	if (!record || record->ino != (uint64_t)fp->ino ||
+	    record->size != (int64_t)fp->size ||
+	    record->mtime_sec != (int64_t)fp->mtime.tv_sec ||
+	    record->mtime_nsec != (int64_t)fp->mtime.tv_nsec ||
+	    record->mtime_sec >= index->header->written_sec) {
+		return INDEX_MISS;
+	}
+
+	if (record->flags & INDEX_FLAG_REJECTED) {
+		return INDEX_REJECTED;
+	}
+
+	header->summary = index_string(index, record->summary);
+	header->uid = index_string(index, record->uid);
+	header->parent_uid = index_string(index, record->parent_uid);
+	header->file_extension = index_string(index, record->file_extension);
+	header->is_directory = record->flags & INDEX_FLAG_DIRECTORY;
+	header->description_size = record->description_size;
+	return INDEX_ENTRY;
+}
+
+struct vdir_index_builder *
+create_vdir_index_builder(void)
+{
+	return xcalloc(1, sizeof(struct vdir_index_builder));
+}
+
+static uint32_t
+builder_add_string(struct vdir_index_builder *builder, const char *str)
+{
+	if (!str) {
+		return INDEX_NO_STRING;
+	}
+
+	size_t len = strlen(str) + 1;
+	if (builder->strings_size + len > builder->strings_capacity) {
+		size_t capacity = builder->strings_capacity
+				      ? builder->strings_capacity * 2
+				      : 4096;
+		while (capacity < builder->strings_size + len) {
+			capacity *= 2;
+		}
+		builder->strings = xreallocarray(builder->strings, capacity, 1);
+		builder->strings_capacity = capacity;
+	}
+
+	uint32_t offset = builder->strings_size;
+	memcpy(builder->strings + offset, str, len);
+	builder->strings_size += len;
+	return offset;
+}
+
+void
+vdir_index_add(struct vdir_index_builder *builder, const char *filename_vdir,
+	       const struct vdir_fingerprint *fp,
+	       const struct ics_header *header)
+{
+	if (builder->count == builder->capacity) {
+		builder->capacity =
+		    builder->capacity ? builder->capacity * 2 : 256;
+		builder->records = xreallocarray(
+		    builder->records, builder->capacity,
+		    sizeof(struct index_record));
+	}
+
+	struct index_record *record = &builder->records[builder->count++];
+	memset(record, 0, sizeof(struct index_record));
+	record->ino = fp->ino;
+	record->size = fp->size;
+	record->mtime_sec = fp->mtime.tv_sec;
+	record->mtime_nsec = fp->mtime.tv_nsec;
+	record->filename_vdir = builder_add_string(builder, filename_vdir);
+
+	if (!header) {
+		record->flags = INDEX_FLAG_REJECTED;
+		record->summary = INDEX_NO_STRING;
+		record->uid = INDEX_NO_STRING;
+		record->parent_uid = INDEX_NO_STRING;
+		record->file_extension = INDEX_NO_STRING;
+		return;
+	}
+
+	record->flags = header->is_directory ? INDEX_FLAG_DIRECTORY : 0;
+	record->description_size = header->description_size;
+	record->summary = builder_add_string(builder, header->summary);
+	record->uid = builder_add_string(builder, header->uid);
+	record->parent_uid = builder_add_string(builder, header->parent_uid);
+	record->file_extension =
+	    builder_add_string(builder, header->file_extension);
+}
+
+static void
+free_vdir_index_builder(struct vdir_index_builder *builder)
+{
+	free(builder->records);
+	free(builder->strings);
+	free(builder);
+}
+
+int
+write_vdir_index(struct vdir_index_builder *builder)
+{
+	char index_path[PATH_MAX];
+	char tmp_path[PATH_MAX + 8];
+	if (get_index_path(index_path, sizeof(index_path), true) != 0) {
+		free_vdir_index_builder(builder);
+		return -1;
+	}
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+
+	struct index_file_header header = {
+	    .magic = INDEX_MAGIC,
+	    .version = INDEX_VERSION,
+	    .record_size = sizeof(struct index_record),
+	    .count = builder->count,
+	    .written_sec = time(NULL),
+	};
+	char real_vdir[PATH_MAX];
+	header.vdir = builder_add_string(builder, get_real_vdir(real_vdir));
+	header.strings_size = builder->strings_size;
+
+	FILE *file = fopen(tmp_path, "w");
+	if (!file) {
+		free_vdir_index_builder(builder);
+		return -1;
+	}
+
+	bool ok =
+	    fwrite(&header, sizeof(header), 1, file) == 1 &&
+	    fwrite(builder->records, sizeof(struct index_record),
+		   builder->count, file) == builder->count &&
+	    fwrite(builder->strings, 1, builder->strings_size, file) ==
+		builder->strings_size;
+	ok &= fclose(file) == 0;
+	free_vdir_index_builder(builder);
+
+	// Readers only ever see a complete index
+	if (!ok || rename(tmp_path, index_path) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef vdir_index_h_INCLUDED
+#define vdir_index_h_INCLUDED
+#include "fuse_node_store.h"
+#include "ical_extra.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// What the previous mount learned about each vdir file, kept in
+// $XDG_CACHE_HOME/agendafs so unchanged files are not read again.
+struct vdir_index;
+
+enum index_lookup {
+	INDEX_MISS,
+	// header is filled in, strings stay valid until the index is closed
+	INDEX_ENTRY,
+	// Not a journal entry
+	INDEX_REJECTED,
+};
+
+// Maps the index of VDIR. Returns NULL if there is none, or if it was
+// written by another version of agendafs.
+struct vdir_index *
+open_vdir_index(void);
+
+void
+close_vdir_index(struct vdir_index *index);
+
+// Safe to call from several threads
+enum index_lookup
+vdir_index_lookup(const struct vdir_index *index, const char *filename_vdir,
+		  const struct vdir_fingerprint *fp, struct ics_header *header);
+
+// Collects the state of the vdir after loading
+struct vdir_index_builder;
+
+struct vdir_index_builder *
+create_vdir_index_builder(void);
+
+// header is NULL for files that are not journal entries
+void
+vdir_index_add(struct vdir_index_builder *builder, const char *filename_vdir,
+	       const struct vdir_fingerprint *fp,
+	       const struct ics_header *header);
+
+// Replaces the index on disk and frees the builder
+int
+write_vdir_index(struct vdir_index_builder *builder);
+
+#endif // vdir_index_h_INCLUDED
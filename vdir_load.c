@@ -0,0 +1,608 @@
+// statx, qsort_r
+#define _GNU_SOURCE
+#include "vdir_load.h"
+#include "agenda_entry.h"
+#include "arena.h"
+#include "fuse_node.h"
+#include "fuse_node_store.h"
+#include "hashmap.h"
+#include "ical_extra.h"
+#include "path.h"
+#include "tree.h"
+#include "util.h"
+#include "vdir_index.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t startup_threads = 0;
+static bool use_vdir_index = true;
+
+// Set once the tree is complete, so fuse operations can skip the lock
+static atomic_bool tree_loaded = false;
+static pthread_mutex_t tree_loaded_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tree_loaded_cond = PTHREAD_COND_INITIALIZER;
+
+// The ics files found while scanning, relative to VDIR
+struct file_list {
+	char **files;
+	ino_t *inodes;
+	size_t count;
+	size_t capacity;
+};
+
+// As returned by getdents64
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// Large enough to list most collections in one call
+#define DIRENT_BUFFER_SIZE (256 * 1024)
+
+enum file_state {
+	FILE_SKIPPED,
+	FILE_REJECTED,
+	FILE_PARSED,
+	FILE_INDEXED,
+};
+
+// Shared by all workers. Each file has its own result slot, so the merge
+// does not depend on which worker parsed it.
+struct load_job {
+	const struct file_list *list;
+	const struct vdir_index *index;
+	int vdir_fd;
+	struct parsed_entry **results;
+	struct vdir_fingerprint *fingerprints;
+	enum file_state *states;
+	// Files are read in inode order, which is roughly disk order
+	size_t *order;
+	atomic_size_t next;
+};
+
+struct load_worker {
+	struct load_job *job;
+	// Results live here until they are merged
+	arena *ar;
+	double read_ms;
+	double parse_ms;
+	size_t indexed;
+	pthread_t thread;
+};
+
+void
+set_startup_threads(size_t threads)
+{
+	startup_threads = threads;
+}
+
+void
+set_vdir_index_enabled(bool enabled)
+{
+	use_vdir_index = enabled;
+}
+
+bool
+is_tree_loaded(void)
+{
+	return atomic_load_explicit(&tree_loaded, memory_order_acquire);
+}
+
+void
+wait_for_tree(void)
+{
+	if (is_tree_loaded()) {
+		return;
+	}
+
+	pthread_mutex_lock(&tree_loaded_lock);
+	while (!is_tree_loaded()) {
+		pthread_cond_wait(&tree_loaded_cond, &tree_loaded_lock);
+	}
+	pthread_mutex_unlock(&tree_loaded_lock);
+}
+
+static void
+mark_tree_loaded(void)
+{
+	pthread_mutex_lock(&tree_loaded_lock);
+	atomic_store_explicit(&tree_loaded, true, memory_order_release);
+	pthread_cond_broadcast(&tree_loaded_cond);
+	pthread_mutex_unlock(&tree_loaded_lock);
+}
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static bool
+is_ics_filename(const char *name)
+{
+	return strstr(name, ".ics") != NULL;
+}
+
+static void
+file_list_add(struct file_list *list, char *filename_vdir, ino_t inode)
+{
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 256;
+		list->files = xreallocarray(list->files, list->capacity,
+					    sizeof(char *));
+		list->inodes = xreallocarray(list->inodes, list->capacity,
+					     sizeof(ino_t));
+	}
+	list->files[list->count] = filename_vdir;
+	list->inodes[list->count] = inode;
+	list->count++;
+}
+
+// Lists the ics files of a collection and the collections nested in it.
+// Returns true if the collection itself holds ics files.
+static bool
+scan_collection(arena *ar, int vdir_fd, const char *collection,
+		struct file_list *list, char *dirents)
+{
+	LOG("Loading collection %s", collection);
+
+	int fd = openat(vdir_fd, *collection ? collection : ".",
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "agendafs: openat %s/%s: %s\n", VDIR,
+			collection, strerror(errno));
+		return false;
+	}
+
+	add_vdir_collection(collection);
+
+	// Directories are scanned after the listing, so one buffer is
+	// enough for the whole recursion
+	size_t subdir_count = 0;
+	char **subdirs = NULL;
+
+	bool has_items = false;
+	long nread;
+	while ((nread = syscall(SYS_getdents64, fd, dirents,
+				DIRENT_BUFFER_SIZE)) > 0) {
+		for (long pos = 0; pos < nread;) {
+			struct linux_dirent64 *entry =
+			    (struct linux_dirent64 *)(dirents + pos);
+			pos += entry->d_reclen;
+
+			// Also skips . and .., and the metadata of sync tools
+			if (pathIsHidden(entry->d_name)) {
+				continue;
+			}
+
+			unsigned char type = entry->d_type;
+			if (type == DT_UNKNOWN) {
+				struct stat st;
+				if (fstatat(fd, entry->d_name, &st,
+					    AT_SYMLINK_NOFOLLOW) != 0) {
+					continue;
+				}
+				type = S_ISDIR(st.st_mode)   ? DT_DIR
+				       : S_ISREG(st.st_mode) ? DT_REG
+							     : DT_UNKNOWN;
+			}
+
+			if (type == DT_DIR) {
+				subdirs = xreallocarray(subdirs,
+							subdir_count + 1,
+							sizeof(char *));
+				subdirs[subdir_count++] = vdir_child_path(
+				    ar, collection, entry->d_name);
+			}
+			if (type == DT_REG && is_ics_filename(entry->d_name)) {
+				has_items = true;
+				file_list_add(list,
+					      vdir_child_path(ar, collection,
+							      entry->d_name),
+					      entry->d_ino);
+			}
+		}
+	}
+	if (nread < 0) {
+		fprintf(stderr, "agendafs: getdents64 %s/%s: %s\n", VDIR,
+			collection, strerror(errno));
+	}
+	close(fd);
+
+	for (size_t i = 0; i < subdir_count; i++) {
+		scan_collection(ar, vdir_fd, subdirs[i], list, dirents);
+	}
+	free(subdirs);
+
+	return has_items;
+}
+
+static void *
+load_worker_run(void *arg)
+{
+	struct load_worker *worker = arg;
+	struct load_job *job = worker->job;
+
+	size_t i;
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->list->count) {
+		i = job->order[i];
+		const char *filename_vdir = job->list->files[i];
+		struct vdir_fingerprint *fp = &job->fingerprints[i];
+		struct timespec start;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		// Only what the fingerprint needs
+		struct statx stx;
+		if (statx(job->vdir_fd, filename_vdir, 0,
+			  STATX_INO | STATX_SIZE | STATX_MTIME, &stx) != 0) {
+			worker->read_ms += elapsed_ms(&start);
+			continue;
+		}
+		fp->ino = stx.stx_ino;
+		fp->size = stx.stx_size;
+		fp->mtime.tv_sec = stx.stx_mtime.tv_sec;
+		fp->mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+
+		struct ics_header header;
+		switch (vdir_index_lookup(job->index, filename_vdir, fp,
+					  &header)) {
+		case INDEX_ENTRY:
+			job->results[i] = parsed_entry_from_header(
+			    worker->ar, filename_vdir, &header, fp);
+			job->states[i] =
+			    job->results[i] ? FILE_INDEXED : FILE_SKIPPED;
+			worker->indexed++;
+			worker->read_ms += elapsed_ms(&start);
+			continue;
+		case INDEX_REJECTED:
+			reject_vdir_file(filename_vdir, fp);
+			job->states[i] = FILE_REJECTED;
+			worker->indexed++;
+			worker->read_ms += elapsed_ms(&start);
+			continue;
+		case INDEX_MISS:
+			break;
+		}
+
+		char *buffer = read_vdir_entry_at(worker->ar, job->vdir_fd,
+						  filename_vdir, fp);
+		worker->read_ms += elapsed_ms(&start);
+		if (!buffer) {
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		job->results[i] =
+		    parse_vdir_buffer(worker->ar, filename_vdir, buffer, fp);
+		// A truncated file is not rejected, it is read again next time
+		if (job->results[i]) {
+			job->states[i] = FILE_PARSED;
+		}
+		else if (is_rejected_vdir_file(filename_vdir, fp)) {
+			job->states[i] = FILE_REJECTED;
+		}
+		else {
+			job->states[i] = FILE_SKIPPED;
+		}
+		worker->parse_ms += elapsed_ms(&start);
+	}
+	return NULL;
+}
+
+static int
+compare_inodes(const void *a, const void *b, void *arg)
+{
+	const struct file_list *list = arg;
+	ino_t ia = list->inodes[*(const size_t *)a];
+	ino_t ib = list->inodes[*(const size_t *)b];
+	return ia < ib ? -1 : ia > ib;
+}
+
+static void
+sort_by_inode(size_t *order, const struct file_list *list)
+{
+	qsort_r(order, list->count, sizeof(size_t), compare_inodes,
+		(void *)list);
+}
+
+static size_t
+get_thread_count(size_t files)
+{
+	size_t threads = startup_threads;
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > files) {
+		threads = files;
+	}
+	return threads ? threads : 1;
+}
+
+// A root that only groups collections is not synced itself, so new
+// entries go to the first collection instead.
+static void
+pick_default_collection(bool root_has_items)
+{
+	if (root_has_items || vdir_collection_count() <= 1) {
+		return;
+	}
+
+	const char *first = get_vdir_collection(1);
+	for (size_t i = 2; i < vdir_collection_count(); i++) {
+		if (strcmp(get_vdir_collection(i), first) < 0) {
+			first = get_vdir_collection(i);
+		}
+	}
+	if (strcmp(get_default_collection(), "") == 0) {
+		set_default_collection(first);
+	}
+}
+
+// Directories are only marked in the file of the parent, so an entry
+// made a parent by another program is written once here
+static void
+mark_as_directory(arena *ar, struct tree_node *parent)
+{
+	LOG("Marking %s as directory", get_node_filename(parent));
+	icalcomponent *ic = get_icalcomponent_from_node(ar, parent);
+	if (ic && !is_directory_component(ic)) {
+		icalcomponent_mark_as_directory(ic);
+		assert(write_ical_file(ar, parent, ic) == 0);
+	}
+}
+
+// True if node is parent or one of its ancestors. Entries pointing at each
+// other as parents would otherwise drop out of the tree.
+static bool
+is_ancestor(const struct tree_node *node, const struct tree_node *parent)
+{
+	for (; parent; parent = parent->parent) {
+		if (parent == node) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Links every parsed entry to its parent using only what was parsed, the
+// files are not read again. Parents are found by the UID property, so
+// any file name works.
+static void
+link_parents(arena *ar, struct parsed_entry **results,
+	     struct tree_node **nodes, size_t count)
+{
+	size_t linked = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!nodes[i]) {
+			continue;
+		}
+
+		const char *parent_uid = results[i]->header.parent_uid;
+		struct tree_node *parent = NULL;
+		if (parent_uid) {
+			parent = get_fuse_node_from_uid(parent_uid);
+			if (!parent) {
+				LOG("COULD NOT FIND PARENT NODE: %s",
+				    parent_uid);
+			}
+		}
+
+		// Names are made unique once every child is attached
+		if (parent && !is_ancestor(nodes[i], parent)) {
+			add_child(parent, nodes[i]);
+		}
+		else {
+			add_child(fuse_root, nodes[i]);
+		}
+		linked++;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (nodes[i] && !results[i]->header.is_directory &&
+		    node_has_children(nodes[i])) {
+			mark_as_directory(ar, nodes[i]);
+		}
+	}
+	LOG("Inserted %zu entries", linked);
+}
+
+static void
+resolve_all_duplicate_names(struct tree_node **nodes, size_t count)
+{
+	resolve_duplicate_names(fuse_root);
+	for (size_t i = 0; i < count; i++) {
+		if (nodes[i]) {
+			resolve_duplicate_names(nodes[i]);
+		}
+	}
+}
+
+// Records what was loaded for the next mount
+static void
+update_vdir_index(const struct load_job *job)
+{
+	struct vdir_index_builder *builder = create_vdir_index_builder();
+	for (size_t i = 0; i < job->list->count; i++) {
+		const char *filename_vdir = job->list->files[i];
+		switch (job->states[i]) {
+		case FILE_PARSED:
+		case FILE_INDEXED:
+			vdir_index_add(builder, filename_vdir,
+				       &job->fingerprints[i],
+				       &job->results[i]->header);
+			break;
+		case FILE_REJECTED:
+			vdir_index_add(builder, filename_vdir,
+				       &job->fingerprints[i], NULL);
+			break;
+		case FILE_SKIPPED:
+			break;
+		}
+	}
+
+	if (write_vdir_index(builder) != 0) {
+		fprintf(stderr, "agendafs: could not write index: %s\n",
+			strerror(errno));
+	}
+}
+
+void
+load_root_node_tree(struct load_stats *stats)
+{
+	struct timespec start, phase;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(stats, 0, sizeof(struct load_stats));
+
+	entries_vdir = hashmap_new_borrowing(NULL);
+	entries_uid = hashmap_new_borrowing(NULL);
+	fuse_root = create_tree_node(NULL, NULL);
+	arena *ar = create_arena();
+	ar->op = "startup";
+	LOG("Loading journal entries from: %s\n", VDIR);
+
+	int vdir_fd = open(VDIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (vdir_fd == -1) {
+		perror("open");
+	}
+
+	struct file_list list = {0};
+	char *dirents = xmalloc(DIRENT_BUFFER_SIZE);
+	bool root_has_items =
+	    vdir_fd != -1 && scan_collection(ar, vdir_fd, "", &list, dirents);
+	free(dirents);
+	pick_default_collection(root_has_items);
+	LOG("New entries go to collection '%s'", get_default_collection());
+	stats->files = list.count;
+	stats->scan_ms = elapsed_ms(&start);
+
+	// Sized once for every file, instead of growing while merging
+	hashmap_reserve(entries_vdir, list.count);
+	hashmap_reserve(entries_uid, list.count);
+
+	size_t slots = list.count ? list.count : 1;
+	struct load_job job = {
+	    .list = &list,
+	    .index = use_vdir_index ? open_vdir_index() : NULL,
+	    .vdir_fd = vdir_fd,
+	    .results = xcalloc(slots, sizeof(struct parsed_entry *)),
+	    .fingerprints = xcalloc(slots, sizeof(struct vdir_fingerprint)),
+	    .states = xcalloc(slots, sizeof(enum file_state)),
+	};
+	atomic_init(&job.next, 0);
+	job.order = xcalloc(slots, sizeof(size_t));
+	for (size_t i = 0; i < list.count; i++) {
+		job.order[i] = i;
+	}
+	sort_by_inode(job.order, &list);
+
+	size_t thread_count = get_thread_count(list.count);
+	struct load_worker *workers =
+	    xcalloc(thread_count, sizeof(struct load_worker));
+	for (size_t i = 0; i < thread_count; i++) {
+		workers[i].job = &job;
+		workers[i].ar = create_arena();
+		workers[i].ar->op = "startup";
+	}
+
+	// The calling thread works as well, so one thread spawns nothing
+	for (size_t i = 1; i < thread_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, load_worker_run,
+				   &workers[i]) != 0) {
+			perror("Failed to create startup thread");
+			exit(1);
+		}
+	}
+	load_worker_run(&workers[0]);
+	for (size_t i = 1; i < thread_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	stats->threads = thread_count;
+	for (size_t i = 0; i < thread_count; i++) {
+		stats->read_ms += workers[i].read_ms;
+		stats->parse_ms += workers[i].parse_ms;
+		stats->indexed += workers[i].indexed;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	struct tree_node **nodes =
+	    xcalloc(list.count ? list.count : 1, sizeof(struct tree_node *));
+	for (size_t i = 0; i < list.count; i++) {
+		if (job.results[i]) {
+			nodes[i] = create_fuse_node(job.results[i]->entry);
+			stats->entries++;
+		}
+		else {
+			LOG("Skipping %s", list.files[i]);
+		}
+	}
+
+	stats->merge_ms = elapsed_ms(&phase);
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	LOG("Set up directories according to parent-child");
+	link_parents(ar, job.results, nodes, list.count);
+	stats->link_ms = elapsed_ms(&phase);
+
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	resolve_all_duplicate_names(nodes, list.count);
+	stats->dedupe_ms = elapsed_ms(&phase);
+
+	if (use_vdir_index) {
+		update_vdir_index(&job);
+	}
+	close_vdir_index((struct vdir_index *)job.index);
+	if (job.vdir_fd != -1) {
+		close(job.vdir_fd);
+	}
+
+	for (size_t i = 0; i < thread_count; i++) {
+		free_all(workers[i].ar);
+	}
+	free(workers);
+	free(nodes);
+	free(job.results);
+	free(job.fingerprints);
+	free(job.states);
+	free(job.order);
+	free(list.files);
+	free(list.inodes);
+	free_all(ar);
+
+	stats->total_ms = elapsed_ms(&start);
+	mark_tree_loaded();
+	LOG("Done");
+}
+
+void
+print_load_stats(const struct load_stats *stats)
+{
+	fprintf(stderr,
+		"agendafs: loaded %zu of %zu files in %.1f ms with %zu "
+		"threads, %zu from the index (scan %.1f ms, read %.1f ms, "
+		"parse %.1f ms, merge %.1f ms, link %.1f ms, dedupe %.1f "
+		"ms)\n",
+		stats->entries, stats->files, stats->total_ms, stats->threads,
+		stats->indexed, stats->scan_ms, stats->read_ms,
+		stats->parse_ms, stats->merge_ms, stats->link_ms,
+		stats->dedupe_ms);
+}
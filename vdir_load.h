@@ -0,0 +1,50 @@
+#ifndef vdir_load_h_INCLUDED
+#define vdir_load_h_INCLUDED
+#include <stdbool.h>
+#include <stddef.h>
+
+// Where the time went while loading the vdir. read_ms and parse_ms are
+// summed over all workers.
+struct load_stats {
+	size_t files;
+	size_t entries;
+	size_t threads;
+	// Files taken from the index without reading them
+	size_t indexed;
+	double scan_ms;
+	double read_ms;
+	double parse_ms;
+	// Creating the nodes
+	double merge_ms;
+	// Attaching them to their parents
+	double link_ms;
+	// Numbering siblings with the same name
+	double dedupe_ms;
+	double total_ms;
+};
+
+// Number of threads reading and parsing the vdir at startup, 0 picks
+// one per CPU.
+void
+set_startup_threads(size_t threads);
+
+// Whether to use and update the index of the previous mount
+void
+set_vdir_index_enabled(bool enabled);
+
+// Builds fuse_root and entries_vdir from VDIR. Nothing may use either
+// until it returns, see wait_for_tree.
+void
+load_root_node_tree(struct load_stats *stats);
+
+bool
+is_tree_loaded(void);
+
+// Blocks until load_root_node_tree is done, returns right away after
+void
+wait_for_tree(void);
+
+void
+print_load_stats(const struct load_stats *stats);
+
+#endif // vdir_load_h_INCLUDED